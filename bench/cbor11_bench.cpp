@@ -0,0 +1,311 @@
+#include "cbor11.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Every allocation made by the process goes through these, so the counters
+// measure what each operation costs in heap traffic. Worker threads of the
+// parallel decoders allocate too, hence the atomics.
+static std::atomic<size_t> allocation_count(0);
+static std::atomic<size_t> allocation_bytes(0);
+
+void *operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *result = std::malloc(size ? size : 1);
+    if (!result) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+// One document of the corpus, with its encoding and number of items.
+struct sample {
+    std::string name;
+    cbor::binary data;
+    size_t items;
+};
+
+static size_t count_items(const cbor &item)
+{
+    size_t count = 1;
+    if (item.is_tagged()) {
+        count += count_items(item.tagged_value());
+    } else if (item.is_array()) {
+        for (const cbor &e : item.as_array()) {
+            count += count_items(e);
+        }
+    } else if (item.is_map()) {
+        for (auto &&e : item.as_map()) {
+            count += count_items(e.first) + count_items(e.second);
+        }
+    }
+    return count;
+}
+
+// Indefinite-length items are counted from their encoding, as decoding
+// them loses the distinction.
+static size_t count_items(const cbor::binary &data)
+{
+    struct counter : cbor_handler {
+        size_t items = 0;
+        void begin_array(uint64_t, bool) override { ++items; }
+        void begin_map(uint64_t, bool) override { ++items; }
+        void unsigned_integer(uint64_t) override { ++items; }
+        void negative_integer(uint64_t) override { ++items; }
+        void begin_binary(uint64_t, bool) override { ++items; }
+        void begin_string(uint64_t, bool) override { ++items; }
+        void tag(uint64_t) override { ++items; }
+        void simple(unsigned) override { ++items; }
+        void floating(double) override { ++items; }
+    } handler;
+    cbor_parser::parse(data.data(), data.size(), handler);
+    return handler.items;
+}
+
+static sample make_sample(const char *name, const cbor &item)
+{
+    return sample {name, cbor::encode(item), count_items(item)};
+}
+
+static cbor make_record(int i)
+{
+    return cbor::map {
+        {"id", i},
+        {"ts", uint64_t(1500000000000ull + i)},
+        {"name", "sensor-" + std::to_string(i % 100)},
+        {"location", "building 7, floor 3, room 12"},
+        {"tags", cbor::array {"alpha", "beta", "gamma"}},
+        {"value", i * 0.25},
+        {"raw", cbor::binary(32, i & 0xff)}
+    };
+}
+
+static std::vector<sample> make_corpus()
+{
+    std::vector<sample> corpus;
+
+    cbor::array records;
+    for (int i = 0; i < 1000; ++i) {
+        records.push_back(make_record(i));
+    }
+    corpus.push_back(make_sample("records", records));
+
+    cbor::array batch;
+    for (int i = 0; i < 200000; ++i) {
+        batch.push_back(make_record(i));
+    }
+    corpus.push_back(make_sample("batch", batch));
+
+    cbor::map wide;
+    for (int i = 0; i < 10000; ++i) {
+        wide["key-" + std::to_string(i)] = i % 3 ? cbor(i) : cbor("value " + std::to_string(i));
+    }
+    corpus.push_back(make_sample("wide_map", wide));
+
+    cbor deep = cbor::array {};
+    for (int i = 0; i < 500; ++i) {
+        deep = cbor::array {i, cbor::map {{"next", std::move(deep)}}};
+    }
+    corpus.push_back(make_sample("deep_nesting", deep));
+
+    cbor::array blobs;
+    for (int i = 0; i < 16; ++i) {
+        blobs.push_back(cbor::binary(1 << 20, i));
+    }
+    corpus.push_back(make_sample("byte_strings", blobs));
+
+    std::vector<double> numbers;
+    for (int i = 0; i < 100000; ++i) {
+        numbers.push_back(i * 0.001 + 1.0 / (i + 1));
+    }
+    corpus.push_back(make_sample("numeric_array", cbor::array(numbers.begin(), numbers.end())));
+    corpus.push_back(make_sample("typed_array", cbor::typed_array(numbers)));
+
+    cbor::binary indefinite;
+    cbor_writer writer(indefinite);
+    writer.begin_array();
+    for (int i = 0; i < 1000; ++i) {
+        writer.begin_map();
+        writer.put("id");
+        writer.put(i);
+        writer.put("values");
+        writer.begin_array();
+        for (int j = 0; j < 8; ++j) {
+            writer.put(i * j);
+        }
+        writer.end();
+        writer.end();
+    }
+    writer.end();
+    corpus.push_back(sample {"indefinite", indefinite, count_items(indefinite)});
+    return corpus;
+}
+
+struct options {
+    bool json = false;
+    double min_time = 0.25;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+// Runs an operation until min_time has passed and reports the averages.
+template <typename Operation>
+static void measure(const options &settings, const sample &input, const char *operation, Operation run)
+{
+    size_t iterations = 0;
+    size_t allocations = allocation_count.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        run(input.data);
+        ++iterations;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < settings.min_time);
+    allocations = allocation_count.load(std::memory_order_relaxed) - allocations;
+
+    double seconds = elapsed / iterations;
+    double mb_per_second = input.data.size() / seconds / 1e6;
+    double items_per_second = input.items / seconds;
+    double allocations_per_message = double(allocations) / iterations;
+    if (settings.json) {
+        std::printf("{\"corpus\":\"%s\",\"operation\":\"%s\",\"bytes\":%zu,\"items\":%zu,\"iterations\":%zu,"
+            "\"seconds\":%.9g,\"mb_per_s\":%.6g,\"items_per_s\":%.6g,\"allocations\":%.6g}\n",
+            input.name.c_str(), operation, input.data.size(), input.items, iterations, seconds, mb_per_second,
+            items_per_second, allocations_per_message);
+    } else {
+        std::printf("%-14s %-14s %10.1f MB/s %12.0f items/s %12.1f allocations/message\n", input.name.c_str(),
+            operation, mb_per_second, items_per_second, allocations_per_message);
+    }
+}
+
+// Heap memory held by a decoded tree, against the number of items in it.
+static void footprint(const options &settings, const sample &input)
+{
+    size_t before = allocation_bytes.load(std::memory_order_relaxed);
+    const cbor decoded = cbor::decode(input.data);
+    size_t bytes = allocation_bytes.load(std::memory_order_relaxed) - before;
+    if (settings.json) {
+        std::printf("{\"corpus\":\"%s\",\"operation\":\"footprint\",\"items\":%zu,\"heap_bytes\":%zu,"
+            "\"node_size\":%zu}\n", input.name.c_str(), input.items, bytes, sizeof(cbor));
+    } else {
+        std::printf("%-14s %-14s %10zu heap bytes %9.1f bytes/item (node is %zu)\n", input.name.c_str(), "footprint",
+            bytes, double(bytes) / input.items, sizeof(cbor));
+    }
+}
+
+static long peak_rss_kb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    options settings;
+    const char *only = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            settings.json = true;
+        } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            settings.min_time = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            settings.max_threads = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::fprintf(stderr, "usage: %s [--json] [--min-time seconds] [--corpus name] [--threads max]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (const sample &input : make_corpus()) {
+        if (only && input.name != only) {
+            continue;
+        }
+        const cbor item = cbor::decode(input.data);
+        cbor::binary buffer;
+        measure(settings, input, "encode", [&](const cbor::binary &) {
+            buffer.clear();
+            cbor::encode_into(item, buffer);
+        });
+        measure(settings, input, "decode", [](const cbor::binary &in) {
+            cbor::decode(in);
+        });
+        measure(settings, input, "decode_arena", [](const cbor::binary &in) {
+            cbor::arena arena;
+            cbor::decode(in, arena);
+        });
+        cbor::intern_table keys;
+        cbor::decode_options interning;
+        interning.intern = &keys;
+        measure(settings, input, "decode_intern", [&](const cbor::binary &in) {
+            cbor::decode(in, interning);
+        });
+        measure(settings, input, "validate", [](const cbor::binary &in) {
+            cbor::validate(in);
+        });
+        measure(settings, input, "copy", [&](const cbor::binary &) {
+            cbor copy = item;
+        });
+        measure(settings, input, "debug", [&](const cbor::binary &) {
+            cbor::debug(item);
+        });
+        footprint(settings, input);
+
+        // Scaling of parallel decoding with the number of threads, for the
+        // array and for the same items as a CBOR sequence
+        if (!item.is_array()) {
+            continue;
+        }
+        cbor::binary sequence;
+        for (const cbor &element : item.as_array()) {
+            cbor::encode_into(element, sequence);
+        }
+        const sample as_sequence {input.name, sequence, input.items - 1};
+        for (unsigned threads = 1; threads <= settings.max_threads; threads *= 2) {
+            std::string parallel = "parallel/" + std::to_string(threads);
+            measure(settings, input, parallel.c_str(), [threads](const cbor::binary &in) {
+                cbor::decode_parallel(in.data(), in.size(), threads);
+            });
+            std::string sequential = "sequence/" + std::to_string(threads);
+            measure(settings, as_sequence, sequential.c_str(), [threads](const cbor::binary &in) {
+                cbor::array items;
+                cbor::decode_sequence(in.data(), in.size(), items, threads);
+            });
+        }
+    }
+
+    if (settings.json) {
+        std::printf("{\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+    } else {
+        std::printf("peak RSS %ld kB\n", peak_rss_kb());
+    }
+    return 0;
+}
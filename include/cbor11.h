@@ -3,13 +3,30 @@
 #if __cplusplus < 201103
 #warning "To enable all features you must compile with -std=c++11"
 #endif
+#include <atomic>
+#include <cstddef>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
 #include <stdint.h>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #if __cplusplus >= 201103
 #include <initializer_list>
 #endif
+#if __cplusplus >= 201703
+#include <optional>
+#include <string_view>
+#endif
+class cbor_view;
+class cbor_writer;
+class cbor_reader;
+template <typename Type, typename Enable = void>
+struct cbor_traits;
 class cbor {
 public:
     enum type_t {
@@ -26,7 +43,7 @@ public:
     typedef std::vector<unsigned char> binary;
     typedef std::string string;
     typedef std::vector<cbor> array;
-    typedef std::map<cbor, cbor> map;
+    class map;
     enum simple {
         SIMPLE_FALSE = 20,
         SIMPLE_TRUE,
@@ -35,28 +52,99 @@ public:
         null = SIMPLE_NULL,
         undefined = SIMPLE_UNDEFINED
     };
+    class arena;
+    class intern_table;
+    class file;
+
+    // Counters that decoding and encoding add to when the library is built
+    // with CBOR11_STATS (the CMake option of that name). Calls add to what is
+    // there, so one struct can total many messages. Without CBOR11_STATS they
+    // are left alone and the instrumentation compiles to nothing.
+    struct stats {
+        stats ();
+
+        // Items by cbor::type_t, map keys included.
+        uint64_t nodes[TYPE_FLOAT + 1];
+        // Heap allocations held by decoded trees, or made for the output of
+        // encoding, and their size in bytes.
+        uint64_t allocations;
+        uint64_t allocated_bytes;
+        // Bytes taken from the arena of decode_options.
+        uint64_t arena_bytes;
+        // Most arrays, maps and tags around any one item.
+        uint64_t max_depth;
+        // Chunks of indefinite-length strings and items of indefinite-length
+        // arrays and maps.
+        uint64_t indefinite_chunks;
+        // Encoded bytes read or written.
+        uint64_t bytes;
+        double seconds;
+    };
+
+    // Settings for cbor::read, cbor::decode and cbor::validate.
+    struct decode_options {
+        decode_options ();
+
+        // Decode string payloads and containers into this arena (decoding only).
+        cbor::arena *arena;
+        // Reject text strings that are not valid UTF-8, as RFC 8949 requires.
+        bool strict_utf8;
+        // Point byte and text strings of definite length into the input
+        // instead of copying them, when decoding from memory. The input must
+        // then outlive the tree. Typed arrays that need swapping or aligning
+        // are still copied.
+        bool borrow;
+        // Add decoding statistics here (decoding only, with CBOR11_STATS).
+        cbor::stats *stats;
+        // Share the text of repeated map keys through this table (decoding
+        // only). Parallel decoding uses it from the calling thread alone.
+        cbor::intern_table *intern;
+        // Limits that make hostile input fail instead of exhausting the stack
+        // or memory (decoding only). Decoding fails on items nested in more
+        // than max_depth arrays, maps and tags, on more than max_bytes of
+        // input, on arrays of more than max_items items and maps of more than
+        // max_items pairs, on byte and text strings longer than
+        // max_string_length bytes and on more than max_nodes items in all.
+        // Only the depth is limited by default.
+        size_t max_depth;
+        uint64_t max_bytes;
+        uint64_t max_items;
+        uint64_t max_string_length;
+        uint64_t max_nodes;
+    };
 
     cbor (unsigned value);
     cbor (uint64_t value);
     cbor (int value);
     cbor (int64_t value);
     cbor (const cbor::binary &value);
+    cbor (cbor::binary &&value);
     cbor (const cbor::string &value);
+    cbor (cbor::string &&value);
     cbor (const char *value);
     cbor (const cbor::array &value);
+    cbor (cbor::array &&value);
     cbor (const cbor::map &value);
+    cbor (cbor::map &&value);
     static cbor tagged(uint64_t tag, const cbor &value);
+    static cbor tagged(uint64_t tag, cbor &&value);
     cbor (cbor::simple value = cbor::SIMPLE_UNDEFINED);
     cbor (bool value);
     cbor (float value);
     cbor (double value);
     cbor (std::nullptr_t);
+    // Copies share the strings, containers and tagged items held on the heap,
+    // counting references atomically, so copying a large tree or handing it
+    // to another thread takes constant time. A shared container is copied,
+    // one level at a time, when it is changed through as_array, as_map or
+    // find. References taken before a copy is made must not be used to
+    // change the original afterwards, as the copy would see that as well.
     cbor(const cbor&);
-    cbor(cbor&&);
+    cbor(cbor&&) noexcept;
     ~cbor();
 
     cbor& operator = (const cbor&);
-    cbor& operator = (cbor&&);
+    cbor& operator = (cbor&&) noexcept;
 
     bool is_unsigned () const;
     bool is_signed () const;
@@ -95,24 +183,174 @@ public:
     
     uint64_t tag () const;
     cbor child () const;
-    
+
+    // References into the item, so nothing is copied. Like the to_ functions
+    // these look through tags. The const versions give an empty array or map
+    // for any other type; the others first replace any other value with an
+    // empty array or map.
+    const cbor::array &as_array () const;
+    cbor::array &as_array ();
+    const cbor::map &as_map () const;
+    cbor::map &as_map ();
+    // The item inside a tag, or undefined for any other type.
+    const cbor &tagged_value () const;
+
+    // Contents of a byte or text string in place, or nullptr for other types.
+    const unsigned char *data () const;
+    // Bytes of a byte or text string, items of an array or pairs of a map.
+    size_t size () const;
+#if __cplusplus >= 201703
+    std::string_view to_string_view () const {
+        return is_string() || (is_tagged() && tagged_value().is_string())
+            ? std::string_view(reinterpret_cast<const char *>(data()), size()) : std::string_view();
+    }
+#endif
+
+    // Array element or map value; undefined when there is none. Looking up
+    // a key never inserts it, and string literal keys are matched in place.
+    const cbor &operator [] (size_t index) const;
+    const cbor &operator [] (const cbor &key) const;
+    template <size_t Size>
+    const cbor &operator [] (const char (&key)[Size]) const {
+        return found(find(key));
+    }
+
+    // Map value for a key, or nullptr when there is none. Text keys are
+    // compared in place and never copied.
+    const cbor *find (const cbor &key) const;
+    cbor *find (const cbor &key);
+    const cbor *find (const char *key) const;
+    cbor *find (const char *key);
+    const cbor *find (const char *key, size_t size) const;
+    cbor *find (const char *key, size_t size);
+#if __cplusplus >= 201703
+    const cbor *find (std::string_view key) const {
+        return find(key.data(), key.size());
+    }
+    cbor *find (std::string_view key) {
+        return find(key.data(), key.size());
+    }
+#endif
+
+    // RFC 8746 typed arrays: a tag from 64 to 87 over a byte string holding
+    // the elements back to back. Decoding puts them in the host's byte order,
+    // switching the tag to match, so to_span () reads the elements in place.
+    // typed_array () and to_span () take uint8_t to uint64_t, int8_t to
+    // int64_t, float and double.
+    template <typename Type>
+    class span {
+    public:
+        span () : m_data(nullptr), m_size(0) { }
+        span (const Type *data, size_t size) : m_data(data), m_size(size) { }
+
+        const Type *data () const { return m_data; }
+        size_t size () const { return m_size; }
+        bool empty () const { return m_size == 0; }
+        const Type *begin () const { return m_data; }
+        const Type *end () const { return m_data + m_size; }
+        const Type &operator [] (size_t index) const { return m_data[index]; }
+    private:
+        const Type *m_data;
+        size_t m_size;
+    };
+    template <typename Type>
+    static cbor typed_array (const Type *data, size_t count);
+    template <typename Type>
+    static cbor typed_array (const std::vector<Type> &values) {
+        return typed_array(values.data(), values.size());
+    }
+    // The elements of a typed array of Type, or an empty span for anything else.
+    template <typename Type>
+    cbor::span<Type> to_span () const;
+
     cbor::type_t type () const;
     
     bool read (std::istream &in);
+    bool read (std::istream &in, const cbor::decode_options &options);
     void write (std::ostream &out) const;
     
+    // Checks that the input is a single well-formed item without decoding it
+    // or allocating, setting error_offset to where it is not. Of the options
+    // only strict_utf8 applies. Definite-length nesting is not limited, but
+    // nesting in more than 128 indefinite-length arrays and maps fails even
+    // where decoding, up to max_depth, would accept it.
     static bool validate (const cbor::binary &in);
+    static bool validate (const unsigned char *data, size_t size);
+    static bool validate (const unsigned char *data, size_t size, size_t &error_offset);
+    static bool validate (const unsigned char *data, size_t size, const cbor::decode_options &options);
+    static bool validate (const unsigned char *data, size_t size, size_t &error_offset,
+        const cbor::decode_options &options);
     static cbor decode (const cbor::binary &in);
+    static cbor decode (const unsigned char *data, size_t size);
+    static cbor decode (const cbor::binary &in, cbor::arena &arena);
+    static cbor decode (const unsigned char *data, size_t size, cbor::arena &arena);
+    static cbor decode (const cbor::binary &in, const cbor::decode_options &options);
+    static cbor decode (const unsigned char *data, size_t size, const cbor::decode_options &options);
+    // Decodes a top-level array on several threads, one per core for 0. Its
+    // items are delimited from their headers alone, then decoded in ranges
+    // in parallel straight into their places. Anything but an array is
+    // decoded as by decode. decode_sequence does the same for the items of
+    // a CBOR sequence (RFC 8742) and returns false, leaving out empty, if
+    // any of them is not well-formed.
+    static cbor decode_parallel (const unsigned char *data, size_t size, unsigned threads = 0);
+    static cbor decode_parallel (const unsigned char *data, size_t size, const cbor::decode_options &options,
+        unsigned threads = 0);
+    static bool decode_sequence (const unsigned char *data, size_t size, cbor::array &out, unsigned threads = 0);
+    static bool decode_sequence (const unsigned char *data, size_t size, cbor::array &out,
+        const cbor::decode_options &options, unsigned threads = 0);
     static cbor::binary encode (const cbor &in);
+    // Encode a C++ value, or decode one, by its cbor_traits, without going
+    // through a cbor tree. Decoding fails unless the input holds exactly
+    // one item of the expected form.
+    template <typename Type>
+    static cbor::binary encode_value (const Type &value);
+    template <typename Type>
+    static bool decode_value (const unsigned char *data, size_t size, Type &value);
+    template <typename Type>
+    static bool decode_value (const cbor::binary &in, Type &value);
+    static cbor::binary encode (const cbor &in, cbor::stats &stats);
+    static void encode_into (const cbor &in, cbor::binary &out);
+    static void encode_into (const cbor &in, cbor::binary &out, cbor::stats &stats);
+    static size_t encode_into (const cbor &in, unsigned char *out, size_t size);
+    static size_t encoded_size (const cbor &in);
     static cbor::string debug (const cbor &in);
     
     bool operator == (const cbor &other) const;
     bool operator != (const cbor &other) const;
     
     bool operator < (const cbor &other) const;
-    void swap(cbor &other);
+    // Bytes used by the item: its node, everything the node owns, and the
+    // string payloads it refers to in an arena or in its input. Container
+    // capacity counts.
+    size_t memory_usage () const;
+
+    // Hash of the contents, consistent with operator ==. Maps keep theirs
+    // once computed, so hashing or comparing an unchanged map again is cheap.
+    uint64_t hash () const;
+    void swap(cbor &other) noexcept;
 private:
+    // Where the payload of a binary, string, array, map or tagged value lives.
+    // Heap payloads are reference counted and shared by copies of the node.
+    // Arena payloads are constructed in a cbor::arena and only destructed,
+    // never deleted. Borrowed byte and text strings point at m_unsigned bytes
+    // starting at m_bytes which the node does not own. Inline byte and text
+    // strings of up to inline_capacity bytes are kept in the node itself,
+    // in the space of both unions, with their size in m_inline_size.
+    enum storage_t {
+        STORAGE_HEAP,
+        STORAGE_ARENA,
+        STORAGE_BORROWED,
+        STORAGE_INLINE
+    };
+    static const size_t inline_capacity = sizeof(uint64_t) + sizeof(void *);
+
     cbor::type_t m_type;
+    unsigned char m_storage = STORAGE_HEAP;
+    unsigned char m_inline_size = 0;
+    // Set on heap containers and tags decoded with strings borrowed from the
+    // input or an intern_table, which copies then copy in full rather than
+    // share, so that they do not depend on either.
+    bool m_borrowing = false;
     union
     {
         uint64_t m_unsigned;
@@ -125,9 +363,1002 @@ private:
         cbor::string *m_string;
         cbor::array *m_array;
         cbor::map *m_map;
+        cbor *m_child;
+        const unsigned char *m_bytes;
     };
 
     void destroy();
+    void unshare ();
+    void typed_array_to_host (bool borrowed);
+    static const cbor &found (const cbor *item);
+    unsigned char *inline_bytes ();
+    const unsigned char *inline_bytes () const;
+    void assign_bytes (const unsigned char *data, size_t size);
+    const unsigned char *bytes_data () const;
+    size_t bytes_size () const;
+
+    size_t payload_memory (size_t &allocations, size_t &heap_bytes) const;
+
+    template <typename Source>
+    bool read_item (Source &in, const cbor::decode_options &options, uint64_t &nodes, size_t depth,
+        bool key = false);
+    static bool read_parallel (const unsigned char *&pos, const unsigned char *end, uint64_t count, bool until_break,
+        cbor::array &out, const cbor::decode_options &options, uint64_t &nodes, unsigned threads, size_t depth);
+    template <typename Sink>
+    void write_item (Sink &out) const;
+
+    friend class cbor_sequence_reader;
+    friend class cbor_decoder;
+};
+
+// Map of items to items, kept as one vector of pairs sorted by key, so lookups
+// are binary searches by content and iteration always runs in key order.
+// Keys order by major type first, then shorter before longer, then by content,
+// which for strings is the order of RFC 8949 deterministic encoding. The
+// interface follows std::map. Keys must not be modified in place, and
+// inserting or erasing invalidates iterators as it would for a vector.
+class cbor::map {
+public:
+    typedef cbor key_type;
+    typedef cbor mapped_type;
+    typedef std::pair<cbor, cbor> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+    typedef size_t size_type;
+
+    map ();
+    map (std::initializer_list<value_type> items);
+    template <typename Iterator>
+    map (Iterator first, Iterator last) : m_items(first, last), m_hash(0) {
+        sort();
+    }
+    map (const map &other);
+    map (map &&other) noexcept;
+    map &operator = (const map &other);
+    map &operator = (map &&other) noexcept;
+
+    iterator begin ();
+    iterator end ();
+    const_iterator begin () const;
+    const_iterator end () const;
+    const_iterator cbegin () const;
+    const_iterator cend () const;
+
+    bool empty () const;
+    size_t size () const;
+    void clear ();
+    void reserve (size_t size);
+
+    iterator find (const cbor &key);
+    const_iterator find (const cbor &key) const;
+    // Lookup of a text key without building a cbor for it.
+    iterator find (const char *key);
+    const_iterator find (const char *key) const;
+    iterator find (const char *key, size_t size);
+    const_iterator find (const char *key, size_t size) const;
+#if __cplusplus >= 201703
+    iterator find (std::string_view key) {
+        return find(key.data(), key.size());
+    }
+    const_iterator find (std::string_view key) const {
+        return find(key.data(), key.size());
+    }
+#endif
+    iterator lower_bound (const cbor &key);
+    const_iterator lower_bound (const cbor &key) const;
+    size_t count (const cbor &key) const;
+    cbor &at (const cbor &key);
+    const cbor &at (const cbor &key) const;
+    cbor &operator [] (const cbor &key);
+    cbor &operator [] (cbor &&key);
+
+    std::pair<iterator, bool> insert (const value_type &item);
+    std::pair<iterator, bool> insert (value_type &&item);
+    std::pair<iterator, bool> emplace (cbor key, cbor value);
+    iterator erase (const_iterator position);
+    size_t erase (const cbor &key);
+
+    bool operator == (const map &other) const;
+    bool operator != (const map &other) const;
+    uint64_t hash () const;
+private:
+    friend class cbor;
+
+    std::vector<value_type> m_items;
+    // Hash of m_items, or 0 until computed. Every non-const member resets it,
+    // so values must not be changed through iterators or references taken
+    // before the map was last hashed.
+    mutable std::atomic<uint64_t> m_hash;
+
+    void changed ();
+    size_t text_position (const char *key, size_t size) const;
+    // Restores key order after items were appended unsorted. Of equal keys
+    // the first one appended is kept, as std::map::insert would.
+    void sort ();
+};
+
+// Monotonic allocator for decoding request-scoped trees. Every byte string,
+// text string and container object of a tree decoded with
+// cbor::decode (data, size, arena) is carved out of the arena's blocks, which
+// are all freed at once by release () or the destructor. Element storage of
+// arrays and maps still comes from their std containers. A tree must be
+// destroyed before the arena it was decoded into, and copies of it are
+// ordinary heap-allocated values.
+class cbor::arena {
+public:
+    explicit arena (size_t block_size = 64 * 1024);
+    ~arena ();
+
+    void *allocate (size_t size, size_t alignment);
+    void release ();
+    // Takes over the blocks of other, leaving it empty, so that whatever was
+    // allocated from either lives as long as this arena.
+    void merge (arena &other);
+
+    size_t bytes_allocated () const;
+    size_t block_count () const;
+private:
+    struct block {
+        block *next;
+        size_t size;
+    };
+
+    block *m_blocks;
+    unsigned char *m_pos;
+    unsigned char *m_end;
+    size_t m_block_size;
+    size_t m_bytes_allocated;
+    size_t m_block_count;
+
+    arena (const arena &) = delete;
+    arena &operator = (const arena &) = delete;
+};
+
+// Storage shared by the text of map keys that repeat from item to item, such
+// as the field names of records. With decode_options::intern set, each text
+// key of definite length that is too long to be kept in its node, up to
+// max_length bytes, is looked up here: the first occurrence is copied in and
+// later ones point at that copy, so a batch of records holds one copy of
+// each name rather than one per record. Once max_keys keys or max_bytes bytes
+// are held, new keys are decoded as usual. Like an arena, the table must
+// outlive the trees pointing into it and serves one decode at a time.
+class cbor::intern_table {
+public:
+    static const size_t max_length = 128;
+
+    explicit intern_table (size_t max_keys = 4096, size_t max_bytes = 256 * 1024);
+
+    // Keys held, and the bytes of their text.
+    size_t size () const;
+    size_t bytes () const;
+    // Keys looked up, and those already in the table.
+    uint64_t lookups () const;
+    uint64_t hits () const;
+    double hit_rate () const;
+
+    // Drops every key and count, invalidating trees that point at the keys.
+    void clear ();
+private:
+    friend class cbor;
+
+    struct slot {
+        const unsigned char *data;
+        size_t size;
+        uint64_t hash;
+    };
+
+    const unsigned char *intern (const unsigned char *data, size_t size);
+
+    std::vector<slot> m_slots;
+    cbor::arena m_storage;
+    size_t m_max_keys;
+    size_t m_max_bytes;
+    size_t m_size;
+    uint64_t m_lookups;
+    uint64_t m_hits;
+
+    intern_table (const intern_table &) = delete;
+    intern_table &operator = (const intern_table &) = delete;
+};
+
+// A file mapped into memory and the item decoded from it. Its byte and text
+// strings of definite length point into the mapping rather than being
+// copied, as with decode_options::borrow. Copies of a file share the mapping
+// and the tree, and the mapping is closed with the last of them, so a
+// reference into the tree is valid while any copy of its file is kept.
+// Where mmap is not available the file is read into memory instead.
+class cbor::file {
+public:
+    file ();
+    explicit file (const std::string &path);
+    file (const std::string &path, const cbor::decode_options &options);
+
+    // False if the file could not be read or does not hold exactly one
+    // valid item, in which case root () is undefined.
+    bool valid () const;
+    const cbor &root () const;
+
+    // The bytes of the file, which view () reads without decoding them.
+    const unsigned char *data () const;
+    size_t size () const;
+    cbor_view view () const;
+private:
+    struct mapping;
+
+    std::shared_ptr<const mapping> m_mapping;
+};
+
+// Read-only view of one item in an encoded buffer. Nothing is decoded up
+// front: accessors parse the item's header when called, and indexing or
+// looking up a key skips over the encoded siblings before it. Any subtree can
+// be decoded into a cbor with to_cbor (). The buffer must outlive the view.
+// A view that points at nothing, as returned by a failed lookup, reads as
+// undefined.
+class cbor_view {
+public:
+    cbor_view ();
+    cbor_view (const unsigned char *data, size_t size);
+    explicit cbor_view (const cbor::binary &data);
+
+    bool valid () const;
+
+    bool is_unsigned () const;
+    bool is_signed () const;
+    bool is_int () const;
+    bool is_binary () const;
+    bool is_string () const;
+    bool is_array () const;
+    bool is_map () const;
+    bool is_tagged () const;
+    bool is_simple () const;
+    bool is_bool () const;
+    bool is_null () const;
+    bool is_undefined () const;
+    bool is_float () const;
+    bool is_number () const;
+
+    uint64_t to_unsigned () const;
+    int64_t to_signed () const;
+    cbor::binary to_binary () const;
+    cbor::string to_string () const;
+    cbor::array to_array () const;
+    cbor::map to_map () const;
+    cbor::simple to_simple () const;
+    bool to_bool () const;
+    double to_float () const;
+
+    uint64_t tag () const;
+    cbor_view child () const;
+
+    cbor::type_t type () const;
+
+    // Bytes of a byte or text string, items of an array or pairs of a map.
+    size_t size () const;
+    cbor_view operator [] (size_t index) const;
+    cbor_view operator [] (const cbor &key) const;
+    cbor_view find (const char *key) const;
+    cbor_view find (const char *key, size_t size) const;
+    cbor_view find (const cbor &key) const;
+
+    // The item at a path of text map keys and array indexes below this one,
+    // such as "meta.route" or "items[3].id", found by skipping over the
+    // encoded siblings on the way without allocating. The empty path is the
+    // item itself. The view is invalid when there is no such item or the
+    // path does not parse; keys holding '.' or '[' can be looked up by find.
+    cbor_view path (const char *query) const;
+    cbor_view path (const cbor::string &query) const;
+    // Decodes only what lies on the given paths, in one pass over the bytes.
+    // Maps keep the keys on a path and arrays the elements up to the last
+    // index on one, with undefined for the elements in between. Paths that
+    // lead nowhere are left out, and the result is undefined if none leads
+    // anywhere or one does not parse.
+    cbor project (const std::vector<cbor::string> &paths) const;
+
+    const unsigned char *data () const;
+    size_t encoded_size () const;
+    cbor to_cbor () const;
+private:
+    struct projection;
+
+    const unsigned char *m_data;
+    const unsigned char *m_end;
+
+    const unsigned char *header (int &major, int &minor, uint64_t &value) const;
+    bool project (const projection &paths, size_t node, cbor &out) const;
 };
 
+// Receives the contents of a document from cbor_parser as a stream of events,
+// in encoding order. Byte and text strings arrive as one or more chunks
+// between their begin and end events, so a handler never needs to hold a
+// whole string. Negative integers are reported by their encoded argument n,
+// standing for -1 - n. Every event does nothing by default.
+class cbor_handler {
+public:
+    virtual ~cbor_handler ();
+
+    virtual void begin_array (uint64_t size, bool indefinite);
+    virtual void end_array ();
+    virtual void begin_map (uint64_t size, bool indefinite);
+    virtual void end_map ();
+    virtual void map_key ();
+    virtual void unsigned_integer (uint64_t value);
+    virtual void negative_integer (uint64_t value);
+    virtual void begin_binary (uint64_t size, bool indefinite);
+    virtual void binary_chunk (const unsigned char *data, size_t size);
+    virtual void end_binary ();
+    virtual void begin_string (uint64_t size, bool indefinite);
+    virtual void string_chunk (const char *data, size_t size);
+    virtual void end_string ();
+    virtual void tag (uint64_t value);
+    virtual void simple (unsigned value);
+    virtual void floating (double value);
+};
+
+// Event-driven parser for a single item. Input is pushed in with feed () in
+// pieces of any size; the parser keeps its position across calls and only
+// holds the header being read plus one small frame per open container, so
+// documents of any size are processed in memory bounded by their nesting.
+// map_key () is sent before each key of a map.
+class cbor_parser {
+public:
+    explicit cbor_parser (cbor_handler &handler);
+
+    // Consumes bytes up to the end of the item and returns how many were used.
+    size_t feed (const unsigned char *data, size_t size);
+    // Bytes the parser can use next without reading past the end of the item.
+    uint64_t wanted () const;
+    bool done () const;
+    bool failed () const;
+    // Bytes consumed so far, which is where the error is when failed ().
+    uint64_t position () const;
+    // While a binary_chunk or string_chunk event is handled, the bytes of
+    // the string, or of the chunk of an indefinite-length string, that are
+    // still to come after it. Zero means the event ends that chunk.
+    uint64_t chunk_remaining () const;
+    void reset ();
+
+    static bool parse (const unsigned char *data, size_t size, cbor_handler &handler);
+    static bool parse (std::istream &in, cbor_handler &handler);
+private:
+    enum frame_t {
+        FRAME_ARRAY,
+        FRAME_MAP,
+        FRAME_TAGGED,
+        FRAME_BINARY,
+        FRAME_STRING
+    };
+
+    // Open container. Definite ones count down the items still to come,
+    // indefinite ones count up the items seen so far.
+    struct frame {
+        frame_t type;
+        bool indefinite;
+        uint64_t items;
+    };
+
+    cbor_handler &m_handler;
+    std::vector<frame> m_stack;
+    unsigned char m_header[9];
+    size_t m_header_size;
+    size_t m_header_needed;
+    uint64_t m_payload;
+    bool m_chunked;
+    int m_payload_major;
+    uint64_t m_position;
+    bool m_done;
+    bool m_failed;
+
+    void header ();
+    void payload (const unsigned char *data, size_t size);
+    void begin_item ();
+    void end_item ();
+};
+
+// Text of a map key with its header worked out at compile time, as written
+// for the field names of mapped structs by cbor_writer::put_key. Names must
+// be shorter than 256 bytes.
+struct cbor_key {
+    template <size_t Size>
+    constexpr cbor_key (const char (&name)[Size]) : name(name), size(Size - 1),
+        header {static_cast<unsigned char>(Size - 1 < 24 ? 0x60 | (Size - 1) : 0x78),
+            static_cast<unsigned char>(Size - 1)},
+        header_size(Size - 1 < 24 ? 1 : 2) {
+        static_assert(Size - 1 < 256, "field names must be shorter than 256 bytes");
+    }
+
+    const char *name;
+    size_t size;
+    unsigned char header[2];
+    size_t header_size;
+};
+
+// Encodes items one at a time straight into a buffer or stream, without
+// building a cbor tree first. Integers, lengths and floats take the same
+// shortest forms as in cbor::write. An array or map opened with a size closes
+// by itself once that many items (pairs, for maps) have been written; one
+// opened without a size is indefinite-length and is closed with end ().
+// Builds without NDEBUG assert that every item fits where it is written.
+class cbor_writer {
+public:
+    explicit cbor_writer (cbor::binary &out);
+    explicit cbor_writer (std::ostream &out);
+
+    void begin_array (uint64_t size);
+    void begin_array ();
+    void begin_map (uint64_t size);
+    void begin_map ();
+    void end ();
+    void tag (uint64_t value);
+
+    void put (unsigned value);
+    void put (uint64_t value);
+    void put (int value);
+    void put (int64_t value);
+    void put (bool value);
+    void put (float value);
+    void put (double value);
+    void put (std::nullptr_t);
+    void put (cbor::simple value);
+    void put (const char *value);
+    void put (const char *value, size_t size);
+    void put (const cbor::string &value);
+    void put (const cbor::binary &value);
+    void put_bytes (const unsigned char *data, size_t size);
+    void put (const cbor &value);
+    void put_key (const cbor_key &key);
+    // Any value with cbor_traits, such as a mapped struct.
+    template <typename Type>
+    void put_value (const Type &value);
+    // An RFC 8746 typed array of the same element types cbor::typed_array
+    // takes, in host byte order unless big_endian is set.
+    template <typename Type>
+    void put_typed (const Type *data, size_t count, bool big_endian = false);
+    template <typename Type>
+    void put_typed (const std::vector<Type> &values, bool big_endian = false) {
+        put_typed(values.data(), values.size(), big_endian);
+    }
+
+    // True when every container opened so far has been closed.
+    bool complete () const;
+private:
+    // Open container. Definite ones count down the items still owed,
+    // indefinite ones count up the items written so far.
+    struct frame {
+        uint64_t items;
+        bool indefinite;
+        bool map;
+    };
+
+    cbor::binary *m_buffer;
+    std::ostream *m_stream;
+    std::vector<frame> m_open;
+
+    void header (int major, uint64_t value);
+    void raw (const void *data, size_t size);
+    void begin_item ();
+    void end_item ();
+};
+
+// Reads the items of a CBOR sequence (RFC 8742), one after another, from
+// memory or from a stream. A stream is read in blocks into one buffer that
+// every item is decoded from and that is reused for the next ones, so
+// reading a long log costs no setup per item. The decode options apply to
+// each item on its own, except that items from a stream never borrow from
+// the buffer. Data in memory must outlive the reader.
+class cbor_sequence_reader {
+public:
+    cbor_sequence_reader (const unsigned char *data, size_t size);
+    cbor_sequence_reader (const unsigned char *data, size_t size, const cbor::decode_options &options);
+    explicit cbor_sequence_reader (std::istream &in);
+    cbor_sequence_reader (std::istream &in, const cbor::decode_options &options);
+
+    // Decodes the next item into item. Returns false at the end of the
+    // sequence and at an item that is malformed, truncated or over a limit,
+    // which error () tells apart.
+    bool next (cbor &item);
+    // Up to count next items, fewer at the end of the sequence or at an
+    // error. The second form reuses the storage of out and returns the
+    // number of items read.
+    cbor::array next_batch (size_t count);
+    size_t next_batch (size_t count, cbor::array &out);
+
+    bool error () const;
+    // Bytes of the sequence taken by the items read so far.
+    uint64_t offset () const;
+private:
+    const unsigned char *m_pos;
+    const unsigned char *m_end;
+    std::istream *m_stream;
+    cbor::binary m_buffer;
+    cbor::decode_options m_options;
+    uint64_t m_offset;
+    bool m_error;
+
+    bool fill ();
+};
+
+// Appends items to a CBOR sequence in memory or on a stream. Items for a
+// stream are encoded into a buffer that is written out once it holds
+// flush_size bytes, on flush () and on destruction.
+class cbor_sequence_writer {
+public:
+    explicit cbor_sequence_writer (cbor::binary &out);
+    explicit cbor_sequence_writer (std::ostream &out, size_t flush_size = 64 * 1024);
+    ~cbor_sequence_writer ();
+
+    void write (const cbor &item);
+    void write_batch (const cbor::array &items);
+    // An item that is already encoded, copied as it is.
+    void write_encoded (const unsigned char *data, size_t size);
+    void flush ();
+
+    // Items written so far.
+    uint64_t count () const;
+private:
+    cbor::binary *m_out;
+    std::ostream *m_stream;
+    cbor::binary m_buffer;
+    size_t m_flush_size;
+    uint64_t m_count;
+
+    cbor_sequence_writer (const cbor_sequence_writer &) = delete;
+    cbor_sequence_writer &operator = (const cbor_sequence_writer &) = delete;
+};
+
+// Decodes one item from input that arrives in pieces, as from a non-blocking
+// socket. Each piece is pushed in with feed () as it comes: a cbor_parser
+// keeps the position in the encoding and the containers and string still
+// open are kept with it, so no byte is read twice and nothing is lost
+// between calls. Bytes after the end of the item are left to the caller,
+// see consumed (). The limits and strict_utf8 of the decode options apply;
+// the tree is built on the heap.
+class cbor_decoder {
+public:
+    enum status_t {
+        STATUS_NEED_MORE,
+        STATUS_COMPLETE,
+        STATUS_ERROR
+    };
+
+    cbor_decoder ();
+    explicit cbor_decoder (const cbor::decode_options &options);
+    ~cbor_decoder ();
+
+    // Once the item is complete or found to be in error, further input is
+    // not taken until reset () or take ().
+    cbor_decoder::status_t feed (const unsigned char *data, size_t size);
+    cbor_decoder::status_t status () const;
+    // Bytes of the last feed () that were used; the rest follow the item.
+    size_t consumed () const;
+    // Bytes of the item taken so far, which is where the error is.
+    uint64_t position () const;
+
+    // The decoded item, undefined until complete. take () moves it out and
+    // makes the decoder ready for the next one.
+    const cbor &item () const;
+    cbor take ();
+    void reset ();
+private:
+    class builder;
+
+    cbor::decode_options m_options;
+    std::unique_ptr<builder> m_builder;
+    cbor_parser m_parser;
+    size_t m_consumed;
+    cbor_decoder::status_t m_status;
+
+    cbor_decoder (const cbor_decoder &) = delete;
+    cbor_decoder &operator = (const cbor_decoder &) = delete;
+};
+
+// Reads the items of an encoded buffer one at a time, to decode them
+// straight into C++ types by their cbor_traits rather than through a cbor
+// tree. Each read takes one item of the kind asked for; anything else makes
+// it fail and leaves the reader failed () from then on. An array or map is
+// walked by calling next (size) with the size from begin_array or
+// begin_map before each of its items (pairs, for maps), which is false
+// after the last one. Indefinite-length containers and strings are read in
+// the same way.
+class cbor_reader {
+public:
+    cbor_reader (const unsigned char *data, size_t size);
+    explicit cbor_reader (const cbor::binary &data);
+
+    // Type of the next item, simple at the end of the input.
+    cbor::type_t type () const;
+
+    bool read (bool &value);
+    bool read (uint64_t &value);
+    bool read (int64_t &value);
+    // Integers are read as floats as well.
+    bool read (double &value);
+    bool read (cbor::string &value);
+    bool read (cbor::binary &value);
+    bool read (cbor &value);
+    // Points at a text string where it is in the input, or gathers one sent
+    // in chunks into buffer and points at that.
+    bool read_text (const char *&data, size_t &size, cbor::string &buffer);
+    // Takes a null or undefined and returns true, or returns false and
+    // leaves the reader as it is.
+    bool read_null ();
+    bool begin_array (uint64_t &size);
+    bool begin_map (uint64_t &size);
+    bool next (uint64_t &size);
+    bool skip ();
+    template <typename Type>
+    bool read_value (Type &value);
+
+    bool failed () const;
+    bool at_end () const;
+    // Bytes read and bytes left.
+    size_t offset () const;
+    size_t remaining () const;
+private:
+    const unsigned char *m_begin;
+    const unsigned char *m_pos;
+    const unsigned char *m_end;
+    bool m_failed;
+
+    bool header (int major, int &minor, uint64_t &value);
+    bool chunks (int major, cbor::string *text, cbor::binary *bytes);
+    bool fail ();
+};
+
+// How a C++ type is written with a cbor_writer and read with a cbor_reader.
+// Specializations are provided for bool, integers, enums (as their value),
+// floats, std::string, cbor::binary, std::vector, std::map, std::optional
+// (C++17; null when empty), cbor itself and structs listed with
+// CBOR11_FIELDS. Others can be added in the same way.
+template <>
+struct cbor_traits<bool> {
+    static void encode (cbor_writer &out, bool value) {
+        out.put(value);
+    }
+    static bool decode (cbor_reader &in, bool &value) {
+        return in.read(value);
+    }
+};
+
+template <typename Type>
+struct cbor_traits<Type, typename std::enable_if<std::is_integral<Type>::value && !std::is_same<Type, bool>::value>::type> {
+    static void encode (cbor_writer &out, Type value) {
+        if (std::is_signed<Type>::value) {
+            out.put(int64_t(value));
+        } else {
+            out.put(uint64_t(value));
+        }
+    }
+    static bool decode (cbor_reader &in, Type &value) {
+        if (std::is_signed<Type>::value) {
+            int64_t result;
+            if (!in.read(result) || result < int64_t(std::numeric_limits<Type>::min())
+                || result > int64_t(std::numeric_limits<Type>::max())) {
+                return false;
+            }
+            value = Type(result);
+        } else {
+            uint64_t result;
+            if (!in.read(result) || result > uint64_t(std::numeric_limits<Type>::max())) {
+                return false;
+            }
+            value = Type(result);
+        }
+        return true;
+    }
+};
+
+template <typename Type>
+struct cbor_traits<Type, typename std::enable_if<std::is_enum<Type>::value>::type> {
+    typedef typename std::underlying_type<Type>::type underlying;
+
+    static void encode (cbor_writer &out, Type value) {
+        cbor_traits<underlying>::encode(out, underlying(value));
+    }
+    static bool decode (cbor_reader &in, Type &value) {
+        underlying result;
+        if (!cbor_traits<underlying>::decode(in, result)) {
+            return false;
+        }
+        value = Type(result);
+        return true;
+    }
+};
+
+template <typename Type>
+struct cbor_traits<Type, typename std::enable_if<std::is_floating_point<Type>::value>::type> {
+    static void encode (cbor_writer &out, Type value) {
+        out.put(value);
+    }
+    static bool decode (cbor_reader &in, Type &value) {
+        double result;
+        if (!in.read(result)) {
+            return false;
+        }
+        value = Type(result);
+        return true;
+    }
+};
+
+template <>
+struct cbor_traits<cbor::string> {
+    static void encode (cbor_writer &out, const cbor::string &value) {
+        out.put(value);
+    }
+    static bool decode (cbor_reader &in, cbor::string &value) {
+        return in.read(value);
+    }
+};
+
+template <>
+struct cbor_traits<cbor::binary> {
+    static void encode (cbor_writer &out, const cbor::binary &value) {
+        out.put(value);
+    }
+    static bool decode (cbor_reader &in, cbor::binary &value) {
+        return in.read(value);
+    }
+};
+
+template <>
+struct cbor_traits<cbor> {
+    static void encode (cbor_writer &out, const cbor &value) {
+        out.put(value);
+    }
+    static bool decode (cbor_reader &in, cbor &value) {
+        return in.read(value);
+    }
+};
+
+template <typename Type, typename Allocator>
+struct cbor_traits<std::vector<Type, Allocator>, typename std::enable_if<!std::is_same<std::vector<Type, Allocator>,
+    cbor::binary>::value>::type> {
+    static void encode (cbor_writer &out, const std::vector<Type, Allocator> &value) {
+        out.begin_array(value.size());
+        for (const Type &item : value) {
+            cbor_traits<Type>::encode(out, item);
+        }
+    }
+    static bool decode (cbor_reader &in, std::vector<Type, Allocator> &value) {
+        uint64_t size;
+        if (!in.begin_array(size)) {
+            return false;
+        }
+        value.clear();
+        // Every item takes at least a byte, so no more are reserved than that.
+        value.reserve(size_t(size < in.remaining() ? size : in.remaining()));
+        while (in.next(size)) {
+            // Decoded aside and moved in, as std::vector<bool> has no
+            // references to its items
+            Type item = Type();
+            if (!cbor_traits<Type>::decode(in, item)) {
+                return false;
+            }
+            value.push_back(std::move(item));
+        }
+        return !in.failed();
+    }
+};
+
+template <typename Key, typename Value, typename Compare, typename Allocator>
+struct cbor_traits<std::map<Key, Value, Compare, Allocator>> {
+    static void encode (cbor_writer &out, const std::map<Key, Value, Compare, Allocator> &value) {
+        out.begin_map(value.size());
+        for (auto &&item : value) {
+            cbor_traits<Key>::encode(out, item.first);
+            cbor_traits<Value>::encode(out, item.second);
+        }
+    }
+    static bool decode (cbor_reader &in, std::map<Key, Value, Compare, Allocator> &value) {
+        uint64_t size;
+        if (!in.begin_map(size)) {
+            return false;
+        }
+        value.clear();
+        while (in.next(size)) {
+            Key key;
+            if (!cbor_traits<Key>::decode(in, key) || !cbor_traits<Value>::decode(in, value[key])) {
+                return false;
+            }
+        }
+        return !in.failed();
+    }
+};
+
+#if __cplusplus >= 201703
+template <typename Type>
+struct cbor_traits<std::optional<Type>> {
+    static void encode (cbor_writer &out, const std::optional<Type> &value) {
+        if (value) {
+            cbor_traits<Type>::encode(out, *value);
+        } else {
+            out.put(nullptr);
+        }
+    }
+    static bool decode (cbor_reader &in, std::optional<Type> &value) {
+        if (in.read_null()) {
+            value.reset();
+            return true;
+        }
+        value.emplace();
+        return cbor_traits<Type>::decode(in, *value);
+    }
+};
+#endif
+
+// Whether a struct field is written at all: empty optionals are left out.
+template <typename Type>
+bool cbor_present (const Type &) {
+    return true;
+}
+
+#if __cplusplus >= 201703
+template <typename Type>
+bool cbor_present (const std::optional<Type> &value) {
+    return value.has_value();
+}
+#endif
+
+// The fields of a struct for cbor_traits, as a map from their names to
+// their values. Specialized by CBOR11_FIELDS.
+template <typename Type>
+struct cbor_fields {
+    static const bool mapped = false;
+};
+
+// Encodes a struct as a map of its fields, in the order they are listed.
+// Decoding takes the fields from a map in any order, skipping keys it does
+// not know and leaving fields that are not there as they were.
+template <typename Type>
+struct cbor_traits<Type, typename std::enable_if<cbor_fields<Type>::mapped>::type> {
+    static void encode (cbor_writer &out, const Type &value) {
+        counter present;
+        cbor_fields<Type>::visit(present, value);
+        out.begin_map(present.fields);
+        writer write {out};
+        cbor_fields<Type>::visit(write, value);
+    }
+    static bool decode (cbor_reader &in, Type &value) {
+        uint64_t size;
+        if (!in.begin_map(size)) {
+            return false;
+        }
+        cbor::string buffer;
+        while (in.next(size)) {
+            reader read {in, nullptr, 0, false, true};
+            if (in.type() != cbor::TYPE_STRING) {
+                in.skip();
+            } else if (in.read_text(read.key, read.size, buffer)) {
+                cbor_fields<Type>::visit(read, value);
+            }
+            if (!read.valid || (!read.found && !in.skip())) {
+                return false;
+            }
+        }
+        return !in.failed();
+    }
+private:
+    struct counter {
+        size_t fields = 0;
+        template <typename Field>
+        void operator () (const cbor_key &, const Field &value) {
+            fields += cbor_present(value);
+        }
+    };
+    struct writer {
+        cbor_writer &out;
+        template <typename Field>
+        void operator () (const cbor_key &key, const Field &value) {
+            if (cbor_present(value)) {
+                out.put_key(key);
+                cbor_traits<Field>::encode(out, value);
+            }
+        }
+    };
+    struct reader {
+        cbor_reader &in;
+        const char *key;
+        size_t size;
+        bool found;
+        bool valid;
+        template <typename Field>
+        void operator () (const cbor_key &field, Field &value) {
+            if (!found && field.size == size && std::char_traits<char>::compare(field.name, key, size) == 0) {
+                found = true;
+                valid = cbor_traits<Field>::decode(in, value);
+            }
+        }
+    };
+};
+
+// Lists the fields of a struct for encoding and decoding it as a map with
+// their names as keys, as in CBOR11_FIELDS(point, x, y, label). It must be
+// used at global scope, after the struct, with up to 32 fields.
+#define CBOR11_FIELDS(Type, ...) \
+    template <> \
+    struct cbor_fields<Type> { \
+        static const bool mapped = true; \
+        template <typename Visitor, typename Object> \
+        static void visit (Visitor &visitor, Object &object) { \
+            CBOR11_FOR_EACH(CBOR11_VISIT_FIELD, __VA_ARGS__) \
+        } \
+    };
+#define CBOR11_VISIT_FIELD(field) visitor(cbor_key(#field), object.field);
+#define CBOR11_EXPAND(x) x
+#define CBOR11_CONCAT(left, right) CBOR11_CONCAT_(left, right)
+#define CBOR11_CONCAT_(left, right) left##right
+#define CBOR11_COUNT_FIELDS(...) CBOR11_EXPAND(CBOR11_NTH_FIELD(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define CBOR11_NTH_FIELD(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, count, ...) count
+#define CBOR11_FOR_EACH(macro, ...) \
+    CBOR11_EXPAND(CBOR11_CONCAT(CBOR11_FOR_EACH_, CBOR11_COUNT_FIELDS(__VA_ARGS__))(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_1(macro, first) macro(first)
+#define CBOR11_FOR_EACH_2(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_1(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_3(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_2(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_4(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_3(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_5(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_4(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_6(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_5(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_7(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_6(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_8(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_7(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_9(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_8(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_10(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_9(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_11(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_10(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_12(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_11(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_13(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_12(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_14(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_13(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_15(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_14(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_16(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_15(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_17(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_16(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_18(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_17(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_19(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_18(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_20(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_19(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_21(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_20(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_22(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_21(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_23(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_22(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_24(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_23(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_25(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_24(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_26(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_25(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_27(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_26(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_28(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_27(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_29(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_28(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_30(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_29(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_31(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_30(macro, __VA_ARGS__))
+#define CBOR11_FOR_EACH_32(macro, first, ...) macro(first) CBOR11_EXPAND(CBOR11_FOR_EACH_31(macro, __VA_ARGS__))
+
+template <typename Type>
+cbor::binary cbor::encode_value(const Type &value) {
+    cbor::binary out;
+    cbor_writer writer(out);
+    cbor_traits<Type>::encode(writer, value);
+    return out;
+}
+
+template <typename Type>
+bool cbor::decode_value(const unsigned char *data, size_t size, Type &value) {
+    cbor_reader in(data, size);
+    return cbor_traits<Type>::decode(in, value) && !in.failed() && in.at_end();
+}
+
+template <typename Type>
+bool cbor::decode_value(const cbor::binary &in, Type &value) {
+    return decode_value(in.data(), in.size(), value);
+}
+
+template <typename Type>
+void cbor_writer::put_value(const Type &value) {
+    cbor_traits<Type>::encode(*this, value);
+}
+
+template <typename Type>
+bool cbor_reader::read_value(Type &value) {
+    return cbor_traits<Type>::decode(*this, value) && !m_failed;
+}
+
 void swap(cbor& left, cbor& right);
+
+namespace std {
+template <>
+struct hash<cbor> {
+    size_t operator () (const cbor &item) const {
+        return size_t(item.hash());
+    }
+};
+}
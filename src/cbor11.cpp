@@ -1,68 +1,184 @@
 #include "cbor11.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CBOR11_NO_SIMD)
+#define CBOR11_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define CBOR11_X86_SIMD 0
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define CBOR11_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CBOR11_MMAP 0
+#endif
 
-cbor::cbor(unsigned value) : m_type(cbor::TYPE_UNSIGNED), m_unsigned(value) { }
+// Adds to a cbor::stats counter when statistics are compiled in.
+#if CBOR11_STATS
+#define CBOR11_COUNT(stats, counter, amount) do { if (stats) { (stats)->counter += (amount); } } while (0)
+#else
+#define CBOR11_COUNT(stats, counter, amount) do { } while (0)
+#endif
+
+namespace {
+
+// Heap payloads are shared by the copies of a node and freed with the last of
+// them. Each is allocated as a counted payload, with the number of nodes
+// referring to it next to the object the node points at.
+template <typename Type>
+struct counted : Type {
+    template <typename... Args>
+    explicit counted(Args &&...args) : Type(std::forward<Args>(args)...), references(1) { }
+
+    std::atomic<size_t> references;
+};
+
+template <typename Type, typename... Args>
+Type *new_payload(Args &&...args) {
+    return new counted<Type>(std::forward<Args>(args)...);
+}
+
+template <typename Type>
+Type *share(Type *payload) {
+    static_cast<counted<Type> *>(payload)->references.fetch_add(1, std::memory_order_relaxed);
+    return payload;
+}
+
+template <typename Type>
+bool shared(const Type *payload) {
+    return static_cast<const counted<Type> *>(payload)->references.load(std::memory_order_acquire) != 1;
+}
+
+} // namespace
+
+cbor::cbor(unsigned value) : m_type(cbor::TYPE_UNSIGNED), m_unsigned(value), m_binary(nullptr) { }
 
 cbor::cbor(int value) : m_type(value < 0 ? cbor::TYPE_NEGATIVE : cbor::TYPE_UNSIGNED),
-    m_integer(value < 0 ? -1 - value : value) { }
+    m_integer(value < 0 ? -1 - value : value), m_binary(nullptr) { }
 
-cbor::cbor(uint64_t value) : m_type(cbor::TYPE_UNSIGNED), m_unsigned(value) { }
+cbor::cbor(uint64_t value) : m_type(cbor::TYPE_UNSIGNED), m_unsigned(value), m_binary(nullptr) { }
 
 cbor::cbor(int64_t value) : m_type(value < 0 ? cbor::TYPE_NEGATIVE : cbor::TYPE_UNSIGNED),
-    m_integer(value < 0 ? -1 - value : value) { }
+    m_integer(value < 0 ? -1 - value : value), m_binary(nullptr) { }
+
+cbor::cbor(const cbor::binary &value) : m_type(cbor::TYPE_BINARY) {
+    assign_bytes(value.data(), value.size());
+}
+
+cbor::cbor(cbor::binary &&value) : m_type(cbor::TYPE_BINARY) {
+    if (value.size() <= inline_capacity) {
+        assign_bytes(value.data(), value.size());
+    } else {
+        m_binary = new_payload<binary>(std::move(value));
+    }
+}
+
+cbor::cbor(const cbor::string &value) : m_type(cbor::TYPE_STRING) {
+    assign_bytes(reinterpret_cast<const unsigned char *>(value.data()), value.size());
+}
+
+cbor::cbor(cbor::string &&value) : m_type(cbor::TYPE_STRING) {
+    if (value.size() <= inline_capacity) {
+        assign_bytes(reinterpret_cast<const unsigned char *>(value.data()), value.size());
+    } else {
+        m_string = new_payload<string>(std::move(value));
+    }
+}
 
-cbor::cbor(const cbor::binary &value) : m_type(cbor::TYPE_BINARY), m_binary(new binary(value)) { }
+cbor::cbor(const char *value) : m_type(cbor::TYPE_STRING) {
+    assign_bytes(reinterpret_cast<const unsigned char *>(value), std::strlen(value));
+}
 
-cbor::cbor(const cbor::string &value) : m_type(cbor::TYPE_STRING), m_string(new string(value)) { }
+cbor::cbor(const cbor::array &value) : m_type(cbor::TYPE_ARRAY), m_unsigned(0), m_array(new_payload<array>(value)) { }
 
-cbor::cbor(const char *value) : m_type(cbor::TYPE_STRING), m_string(new string(value)) { }
+cbor::cbor(cbor::array &&value) : m_type(cbor::TYPE_ARRAY), m_unsigned(0), m_array(new_payload<array>(std::move(value))) { }
 
-cbor::cbor(const cbor::array &value) : m_type(cbor::TYPE_ARRAY), m_array(new array(value)) { }
+cbor::cbor(const cbor::map &value) : m_type(cbor::TYPE_MAP), m_unsigned(0), m_map(new_payload<map>(value)) { }
 
-cbor::cbor(const cbor::map &value) : m_type(cbor::TYPE_MAP), m_map(new map(value)) { }
+cbor::cbor(cbor::map &&value) : m_type(cbor::TYPE_MAP), m_unsigned(0), m_map(new_payload<map>(std::move(value))) { }
 
 cbor cbor::tagged(uint64_t tag, const cbor &value) {
+    return tagged(tag, cbor(value));
+}
+
+cbor cbor::tagged(uint64_t tag, cbor &&value) {
     cbor result;
     result.m_type = cbor::TYPE_TAGGED;
     result.m_unsigned = tag;
-    result.m_array = new cbor::array(1, value);
+    result.m_child = new_payload<cbor>(std::move(value));
     return result;
 }
 
-cbor::cbor(cbor::simple value) : m_type(cbor::TYPE_SIMPLE), m_unsigned(value & 255) { }
+cbor::cbor(cbor::simple value) : m_type(cbor::TYPE_SIMPLE), m_unsigned(value & 255), m_binary(nullptr) { }
 
-cbor::cbor(bool value) : m_type(cbor::TYPE_SIMPLE), m_unsigned(value ? cbor::SIMPLE_TRUE : cbor::SIMPLE_FALSE) { }
+cbor::cbor(bool value) : m_type(cbor::TYPE_SIMPLE), m_unsigned(value ? cbor::SIMPLE_TRUE : cbor::SIMPLE_FALSE),
+    m_binary(nullptr) { }
 
-cbor::cbor(float value) : m_type(cbor::TYPE_FLOAT), m_float(value) { }
+cbor::cbor(float value) : m_type(cbor::TYPE_FLOAT), m_float(value), m_binary(nullptr) { }
 
-cbor::cbor(double value) : m_type(cbor::TYPE_FLOAT), m_float(value) { }
+cbor::cbor(double value) : m_type(cbor::TYPE_FLOAT), m_float(value), m_binary(nullptr) { }
 
-cbor::cbor(std::nullptr_t) : m_type(cbor::TYPE_SIMPLE), m_unsigned(cbor::SIMPLE_NULL) { }
+cbor::cbor(std::nullptr_t) : m_type(cbor::TYPE_SIMPLE), m_unsigned(cbor::SIMPLE_NULL), m_binary(nullptr) { }
 
+// Heap payloads are shared rather than copied. Those in an arena or in the
+// input, and containers holding strings borrowed from elsewhere, are copied
+// to the heap, as the copy may outlive them.
 cbor::cbor(const cbor& other) : m_type(other.m_type), m_unsigned(other.m_unsigned) {
+    bool heap = other.m_storage == STORAGE_HEAP && !other.m_borrowing;
     switch(other.m_type)
     {
         case TYPE_BINARY:
-            m_binary = new binary(*other.m_binary);
+            if (heap) {
+                m_binary = share(other.m_binary);
+            } else {
+                assign_bytes(other.bytes_data(), other.bytes_size());
+            }
             break;
         case TYPE_STRING:
-            m_string = new string(*other.m_string);
+            if (heap) {
+                m_string = share(other.m_string);
+            } else {
+                assign_bytes(other.bytes_data(), other.bytes_size());
+            }
             break;
         case TYPE_TAGGED:
-            // fallthrough
+            m_child = heap ? share(other.m_child) : new_payload<cbor>(*other.m_child);
+            break;
         case TYPE_ARRAY:
-            m_array = new array(*other.m_array);
+            m_array = heap ? share(other.m_array) : new_payload<array>(*other.m_array);
             break;
         case TYPE_MAP:
-            m_map = new map(*other.m_map);
+            m_map = heap ? share(other.m_map) : new_payload<map>(*other.m_map);
             break;
         default:
             break;
     }
 }
 
-cbor::cbor(cbor&& other) : m_type(other.m_type), m_unsigned(other.m_unsigned), m_binary(other.m_binary) { 
+cbor::cbor(cbor&& other) noexcept : m_type(other.m_type), m_storage(other.m_storage),
+    m_inline_size(other.m_inline_size), m_borrowing(other.m_borrowing), m_unsigned(other.m_unsigned),
+    m_binary(other.m_binary) {
+    // Leave the source as a valid undefined value rather than a container with no storage
+    other.m_type = cbor::TYPE_SIMPLE;
+    other.m_storage = STORAGE_HEAP;
+    other.m_borrowing = false;
+    other.m_unsigned = cbor::SIMPLE_UNDEFINED;
     other.m_binary = nullptr;
 }
 
@@ -74,32 +190,11 @@ cbor& cbor::operator = (const cbor& other) {
     if(this == &other) {
         return *this;
     }
-    destroy();
-    m_type = other.m_type;
-    m_unsigned = other.m_unsigned;
-    switch(m_type)
-    {
-        case TYPE_BINARY:
-            m_binary = new binary(*other.m_binary);
-            break;
-        case TYPE_STRING:
-            m_string = new string(*other.m_string);
-            break;
-        case TYPE_TAGGED:
-            // fallthrough
-        case TYPE_ARRAY:
-            m_array = new array(*other.m_array);
-            break;
-        case TYPE_MAP:
-            m_map = new map(*other.m_map);
-            break;
-        default:
-            return *this;
-    }
+    cbor(other).swap(*this);
     return *this;
 }
 
-cbor& cbor::operator = (cbor&& other) {
+cbor& cbor::operator = (cbor&& other) noexcept {
     if(this == &other) {
         return *this;
     }
@@ -107,8 +202,11 @@ cbor& cbor::operator = (cbor&& other) {
     return *this;
 }
 
-void cbor::swap(cbor& other) {
+void cbor::swap(cbor& other) noexcept {
     std::swap(m_type, other.m_type);
+    std::swap(m_storage, other.m_storage);
+    std::swap(m_inline_size, other.m_inline_size);
+    std::swap(m_borrowing, other.m_borrowing);
     std::swap(m_unsigned, other.m_unsigned);
     std::swap(m_binary, other.m_binary);
 }
@@ -176,7 +274,7 @@ uint64_t cbor::to_unsigned() const {
     case cbor::TYPE_NEGATIVE:
         return m_integer;
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_unsigned();
+        return m_child->to_unsigned();
     case cbor::TYPE_FLOAT:
         return m_float;
     default:
@@ -191,7 +289,7 @@ int64_t cbor::to_signed() const {
     case cbor::TYPE_NEGATIVE:
         return -1 - m_integer;
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_signed();
+        return m_child->to_signed();
     case cbor::TYPE_FLOAT:
         return m_float;
     default:
@@ -202,9 +300,9 @@ int64_t cbor::to_signed() const {
 cbor::binary cbor::to_binary() const {
     switch (m_type) {
     case cbor::TYPE_BINARY:
-        return *m_binary;
+        return cbor::binary(bytes_data(), bytes_data() + bytes_size());
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_binary();
+        return m_child->to_binary();
     default:
         return cbor::binary();
     }
@@ -213,9 +311,9 @@ cbor::binary cbor::to_binary() const {
 cbor::string cbor::to_string() const {
     switch (m_type) {
     case cbor::TYPE_STRING:
-        return *m_string;
+        return cbor::string(reinterpret_cast<const char *>(bytes_data()), bytes_size());
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_string();
+        return m_child->to_string();
     default:
         return cbor::string();
     }
@@ -226,7 +324,7 @@ cbor::array cbor::to_array() const {
     case cbor::TYPE_ARRAY:
         return *m_array;
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_array();
+        return m_child->to_array();
     default:
         return cbor::array();
     }
@@ -237,7 +335,7 @@ cbor::map cbor::to_map() const {
     case cbor::TYPE_MAP:
         return *m_map;
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_map();
+        return m_child->to_map();
     default:
         return cbor::map();
     }
@@ -246,7 +344,7 @@ cbor::map cbor::to_map() const {
 cbor::simple cbor::to_simple() const {
     switch (m_type) {
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_simple();
+        return m_child->to_simple();
     case cbor::TYPE_SIMPLE:
         return cbor::simple(m_unsigned);
     default:
@@ -257,7 +355,7 @@ cbor::simple cbor::to_simple() const {
 bool cbor::to_bool() const {
     switch (m_type) {
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_bool();
+        return m_child->to_bool();
     case cbor::TYPE_SIMPLE:
         return m_unsigned == cbor::SIMPLE_TRUE;
     default:
@@ -270,9 +368,9 @@ double cbor::to_float() const {
     case cbor::TYPE_UNSIGNED:
         return double(m_unsigned);
     case cbor::TYPE_NEGATIVE:
-        return ldexp(-1 - (m_integer >> 32), 32) + (-1 - (m_integer << 32 >> 32));
+        return -1.0 - double(m_unsigned);
     case cbor::TYPE_TAGGED:
-        return m_array->front().to_float();
+        return m_child->to_float();
     case cbor::TYPE_FLOAT:
         return m_float;
     default:
@@ -332,12 +430,163 @@ uint64_t cbor::tag() const {
 cbor cbor::child() const {
     switch (this->m_type) {
     case cbor::TYPE_TAGGED:
-        return m_array->front();
+        return *m_child;
     default:
         return cbor();
     }
 }
 
+namespace {
+
+// Shared empty values for the reference accessors to return on a mismatch.
+const cbor &undefined_item() {
+    static const cbor item;
+    return item;
+}
+
+const cbor::array &empty_array() {
+    static const cbor::array items;
+    return items;
+}
+
+const cbor::map &empty_map() {
+    static const cbor::map items;
+    return items;
+}
+
+} // namespace
+
+const cbor::array &cbor::as_array() const {
+    switch (m_type) {
+    case cbor::TYPE_ARRAY:
+        return *m_array;
+    case cbor::TYPE_TAGGED:
+        return tagged_value().as_array();
+    default:
+        return empty_array();
+    }
+}
+
+cbor::array &cbor::as_array() {
+    unshare();
+    if (m_type == cbor::TYPE_TAGGED) {
+        return m_child->as_array();
+    }
+    if (m_type != cbor::TYPE_ARRAY) {
+        *this = cbor::array();
+    }
+    return *m_array;
+}
+
+const cbor::map &cbor::as_map() const {
+    switch (m_type) {
+    case cbor::TYPE_MAP:
+        return *m_map;
+    case cbor::TYPE_TAGGED:
+        return tagged_value().as_map();
+    default:
+        return empty_map();
+    }
+}
+
+cbor::map &cbor::as_map() {
+    unshare();
+    if (m_type == cbor::TYPE_TAGGED) {
+        return m_child->as_map();
+    }
+    if (m_type != cbor::TYPE_MAP) {
+        *this = cbor::map();
+    }
+    return *m_map;
+}
+
+const cbor &cbor::tagged_value() const {
+    return m_type == cbor::TYPE_TAGGED ? *m_child : undefined_item();
+}
+
+const unsigned char *cbor::data() const {
+    switch (m_type) {
+    case cbor::TYPE_BINARY:
+    case cbor::TYPE_STRING:
+        return bytes_data();
+    case cbor::TYPE_TAGGED:
+        return m_child->data();
+    default:
+        return nullptr;
+    }
+}
+
+size_t cbor::size() const {
+    switch (m_type) {
+    case cbor::TYPE_BINARY:
+    case cbor::TYPE_STRING:
+        return bytes_size();
+    case cbor::TYPE_ARRAY:
+        return m_array->size();
+    case cbor::TYPE_MAP:
+        return m_map->size();
+    case cbor::TYPE_TAGGED:
+        return m_child->size();
+    default:
+        return 0;
+    }
+}
+
+const cbor &cbor::found(const cbor *item) {
+    return item ? *item : undefined_item();
+}
+
+const cbor &cbor::operator [] (size_t index) const {
+    const cbor::array &items = as_array();
+    return index < items.size() ? items[index] : undefined_item();
+}
+
+const cbor &cbor::operator [] (const cbor &key) const {
+    return found(find(key));
+}
+
+const cbor *cbor::find(const cbor &key) const {
+    const cbor::map &items = as_map();
+    cbor::map::const_iterator it = items.find(key);
+    return it != items.end() ? &it->second : nullptr;
+}
+
+cbor *cbor::find(const cbor &key) {
+    const cbor::map &items = static_cast<const cbor &>(*this).as_map();
+    cbor::map::const_iterator it = items.find(key);
+    if (it == items.end()) {
+        return nullptr;
+    }
+    cbor::map &writable = as_map();
+    writable.changed();
+    return &writable.m_items[it - items.begin()].second;
+}
+
+const cbor *cbor::find(const char *key) const {
+    return find(key, std::strlen(key));
+}
+
+cbor *cbor::find(const char *key) {
+    return find(key, std::strlen(key));
+}
+
+const cbor *cbor::find(const char *key, size_t size) const {
+    const cbor::map &items = as_map();
+    cbor::map::const_iterator it = items.find(key, size);
+    return it != items.end() ? &it->second : nullptr;
+}
+
+cbor *cbor::find(const char *key, size_t size) {
+    const cbor::map &items = static_cast<const cbor &>(*this).as_map();
+    cbor::map::const_iterator it = items.find(key, size);
+    if (it == items.end()) {
+        return nullptr;
+    }
+    cbor::map &writable = as_map();
+    writable.changed();
+    return &writable.m_items[it - items.begin()].second;
+}
+
 bool cbor::operator < (const cbor &other) const {
     if (this->m_type < other.m_type) {
         return true;
@@ -347,16 +596,30 @@ bool cbor::operator < (const cbor &other) const {
     }
     switch (m_type) {
     case cbor::TYPE_BINARY:
-        return m_binary < other.m_binary;
-    case cbor::TYPE_STRING:
-        return m_string < other.m_string;
+        // fallthrough
+    case cbor::TYPE_STRING: {
+        // Shorter first, then bytewise, which is the order of their encodings
+        size_t size = bytes_size();
+        size_t other_size = other.bytes_size();
+        if (size != other_size) {
+            return size < other_size;
+        }
+        return size != 0 && std::memcmp(bytes_data(), other.bytes_data(), size) < 0;
+    }
     case cbor::TYPE_ARRAY:
-        return m_array < other.m_array;
+        if (m_array->size() != other.m_array->size()) {
+            return m_array->size() < other.m_array->size();
+        }
+        return std::lexicographical_compare(m_array->begin(), m_array->end(),
+            other.m_array->begin(), other.m_array->end());
     case cbor::TYPE_MAP:
-        return m_map < other.m_map;
+        if (m_map->size() != other.m_map->size()) {
+            return m_map->size() < other.m_map->size();
+        }
+        return std::lexicographical_compare(m_map->begin(), m_map->end(), other.m_map->begin(), other.m_map->end());
     case cbor::TYPE_TAGGED:
         if (m_unsigned == other.m_unsigned) {
-            return m_array->front() < other.m_array->front();
+            return *m_child < *other.m_child;
         }
         // fallthrough
     default:
@@ -370,18 +633,19 @@ bool cbor::operator == (const cbor &other) const {
     }
     switch (m_type) {
     case cbor::TYPE_BINARY:
-        return m_binary == other.m_binary;
+        // fallthrough
     case cbor::TYPE_STRING:
-        return m_string == other.m_string;
+        return bytes_size() == other.bytes_size()
+            && (bytes_size() == 0 || std::memcmp(bytes_data(), other.bytes_data(), bytes_size()) == 0);
     case cbor::TYPE_ARRAY:
-        return m_array == other.m_array;
+        return m_array == other.m_array || *m_array == *other.m_array;
     case cbor::TYPE_MAP:
-        return m_map == other.m_map;
+        return m_map == other.m_map || *m_map == *other.m_map;
     case cbor::TYPE_TAGGED:
         if (m_unsigned != other.m_unsigned) {
             return false;
         }
-        return m_array == other.m_array;
+        return m_child == other.m_child || *m_child == *other.m_child;
     default:
         return m_unsigned == other.m_unsigned;
     }
@@ -391,492 +655,4511 @@ bool cbor::operator != (const cbor &other) const {
     return !(*this == other);
 }
 
-void read_uint(std::istream &in, int &major, int &minor, uint64_t &value) {
-    major = (in.peek() >> 5) & 7;
-    minor = in.get() & 31;
-    value = 0;
-    switch (minor) {
-    case 27:
-        value |= (unsigned long long) in.get() << 56;
-        value |= (unsigned long long) in.get() << 48;
-        value |= (unsigned long long) in.get() << 40;
-        value |= (unsigned long long) in.get() << 32;
-    case 26:
-        value |= in.get() << 24;
-        value |= in.get() << 16;
-    case 25:
-        value |= in.get() << 8;
-    case 24:
-        value |= in.get();
-        break;
-    default:
-        value = minor;
-        break;
+namespace {
+
+// Final mixing step of MurmurHash3, spreading every input bit over the result.
+uint64_t mix_hash(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+uint64_t combine_hash(uint64_t seed, uint64_t value) {
+    return mix_hash(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+uint64_t hash_bytes(uint64_t seed, const unsigned char *data, size_t size) {
+    uint64_t result = combine_hash(seed, size);
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        result = combine_hash(result, word);
     }
+    if (size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data, size);
+        result = combine_hash(result, word);
+    }
+    return result;
 }
 
-bool cbor::read(std::istream &in) {
-    cbor item;
-    int major, minor;
-    uint64_t value;
-    read_uint(in, major, minor, value);
-    switch (major) {
-    case 0:
-        if (minor > 27) {
-            in.setstate(std::ios_base::failbit);
-            return false;
-        }
-        item.m_type = cbor::TYPE_UNSIGNED;
-        item.m_unsigned = value;
-        break;
-    case 1:
-        if (minor > 27) {
-            in.setstate(std::ios_base::failbit);
-            return false;
-        }
-        item.m_type = cbor::TYPE_NEGATIVE;
-        item.m_integer = value;
-        break;
-    case 2:
-        if (minor > 27 && minor < 31) {
-            in.setstate(std::ios_base::failbit);
-            return false;
+} // namespace
+
+uint64_t cbor::hash() const {
+    switch (m_type) {
+    case cbor::TYPE_BINARY:
+    case cbor::TYPE_STRING:
+        return hash_bytes(m_type, bytes_data(), bytes_size());
+    case cbor::TYPE_ARRAY: {
+        uint64_t result = combine_hash(m_type, m_array->size());
+        for (const cbor &item : *m_array) {
+            result = combine_hash(result, item.hash());
         }
-        item.m_type = cbor::TYPE_BINARY;
-        item.m_binary = new binary;
-        if (minor == 31) {
-            while (in.good() && in.peek() != 255) {
-                read_uint(in, major, minor, value);
-                if (major != 2 || minor > 27) {
-                    in.setstate(std::ios_base::failbit);
-                    return false;
-                }
-                for (uint64_t i = 0; in.good() && i != value; ++i) {
-                    item.m_binary->push_back(in.get());
-                }
-            }
-            in.get();
+        return result;
+    }
+    case cbor::TYPE_MAP:
+        return m_map->hash();
+    case cbor::TYPE_TAGGED:
+        return combine_hash(combine_hash(m_type, m_unsigned), m_child->hash());
+    default:
+        return combine_hash(m_type, m_unsigned);
+    }
+}
+
+namespace {
+
+bool key_less(const cbor::map::value_type &item, const cbor &key) {
+    return item.first < key;
+}
+
+bool item_less(const cbor::map::value_type &left, const cbor::map::value_type &right) {
+    return left.first < right.first;
+}
+
+bool same_key(const cbor::map::value_type &left, const cbor::map::value_type &right) {
+    return !(left.first < right.first) && !(right.first < left.first);
+}
+
+} // namespace
+
+cbor::map::map() : m_hash(0) { }
+
+cbor::map::map(std::initializer_list<value_type> items) : m_items(items), m_hash(0) {
+    sort();
+}
+
+cbor::map::map(const map &other) : m_items(other.m_items), m_hash(other.m_hash.load(std::memory_order_relaxed)) { }
+
+cbor::map::map(map &&other) noexcept : m_items(std::move(other.m_items)),
+    m_hash(other.m_hash.load(std::memory_order_relaxed)) {
+    other.changed();
+}
+
+cbor::map &cbor::map::operator = (const map &other) {
+    m_items = other.m_items;
+    m_hash.store(other.m_hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+}
+
+cbor::map &cbor::map::operator = (map &&other) noexcept {
+    m_items = std::move(other.m_items);
+    m_hash.store(other.m_hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    other.changed();
+    return *this;
+}
+
+void cbor::map::changed() {
+    m_hash.store(0, std::memory_order_relaxed);
+}
+
+cbor::map::iterator cbor::map::begin() {
+    changed();
+    return m_items.begin();
+}
+
+cbor::map::iterator cbor::map::end() {
+    changed();
+    return m_items.end();
+}
+
+cbor::map::const_iterator cbor::map::begin() const {
+    return m_items.begin();
+}
+
+cbor::map::const_iterator cbor::map::end() const {
+    return m_items.end();
+}
+
+cbor::map::const_iterator cbor::map::cbegin() const {
+    return m_items.begin();
+}
+
+cbor::map::const_iterator cbor::map::cend() const {
+    return m_items.end();
+}
+
+bool cbor::map::empty() const {
+    return m_items.empty();
+}
+
+size_t cbor::map::size() const {
+    return m_items.size();
+}
+
+void cbor::map::clear() {
+    changed();
+    m_items.clear();
+}
+
+void cbor::map::reserve(size_t size) {
+    m_items.reserve(size);
+}
+
+cbor::map::iterator cbor::map::lower_bound(const cbor &key) {
+    changed();
+    return std::lower_bound(m_items.begin(), m_items.end(), key, key_less);
+}
+
+cbor::map::const_iterator cbor::map::lower_bound(const cbor &key) const {
+    return std::lower_bound(m_items.begin(), m_items.end(), key, key_less);
+}
+
+cbor::map::iterator cbor::map::find(const cbor &key) {
+    iterator it = lower_bound(key);
+    return it != m_items.end() && !(key < it->first) ? it : m_items.end();
+}
+
+cbor::map::const_iterator cbor::map::find(const cbor &key) const {
+    const_iterator it = lower_bound(key);
+    return it != m_items.end() && !(key < it->first) ? it : m_items.end();
+}
+
+cbor::map::iterator cbor::map::find(const char *key) {
+    return find(key, std::strlen(key));
+}
+
+cbor::map::const_iterator cbor::map::find(const char *key) const {
+    return find(key, std::strlen(key));
+}
+
+cbor::map::iterator cbor::map::find(const char *key, size_t size) {
+    changed();
+    return m_items.begin() + text_position(key, size);
+}
+
+cbor::map::const_iterator cbor::map::find(const char *key, size_t size) const {
+    return m_items.begin() + text_position(key, size);
+}
+
+// Binary search comparing keys against the text in the order of
+// cbor::operator <, for a text string key that only exists as bytes.
+size_t cbor::map::text_position(const char *key, size_t size) const {
+    size_t low = 0;
+    size_t high = m_items.size();
+    while (low != high) {
+        size_t middle = low + (high - low) / 2;
+        const cbor &item = m_items[middle].first;
+        int order;
+        if (item.m_type != cbor::TYPE_STRING) {
+            order = item.m_type < cbor::TYPE_STRING ? -1 : 1;
+        } else if (item.bytes_size() != size) {
+            order = item.bytes_size() < size ? -1 : 1;
         } else {
-            item.m_binary->reserve(value);
-            for (uint64_t i = 0; in.good() && i != value; ++i) {
-                item.m_binary->push_back(in.get());
-            }
+            order = size ? std::memcmp(item.bytes_data(), key, size) : 0;
         }
-        break;
-    case 3:
-        if (minor > 27 && minor < 31) {
-            in.setstate(std::ios_base::failbit);
-            return false;
+        if (order == 0) {
+            return middle;
         }
-        item.m_type = cbor::TYPE_STRING;
-        item.m_string = new string;
-        if (minor == 31) {
-            while (in.good() && in.peek() != 255) {
-                read_uint(in, major, minor, value);
-                if (major  != 3 || minor > 27) {
-                    in.setstate(std::ios_base::failbit);
-                    return false;
-                }
-                for (uint64_t i = 0; in.good() && i != value; ++i) {
-                    item.m_string->push_back(in.get());
-                }
-            }
-            in.get();
+        if (order < 0) {
+            low = middle + 1;
         } else {
-            item.m_string->reserve(value);
-            for (uint64_t i = 0; in.good() && i != value; ++i) {
-                item.m_string->push_back(in.get());
-            }
+            high = middle;
         }
-        break;
-    case 4:
-        if (minor > 27 && minor < 31) {
-            in.setstate(std::ios_base::failbit);
+    }
+    return m_items.size();
+}
+
+size_t cbor::map::count(const cbor &key) const {
+    return find(key) != m_items.end();
+}
+
+cbor &cbor::map::at(const cbor &key) {
+    iterator it = find(key);
+    if (it == m_items.end()) {
+        throw std::out_of_range("cbor::map::at");
+    }
+    return it->second;
+}
+
+const cbor &cbor::map::at(const cbor &key) const {
+    const_iterator it = find(key);
+    if (it == m_items.end()) {
+        throw std::out_of_range("cbor::map::at");
+    }
+    return it->second;
+}
+
+cbor &cbor::map::operator [] (const cbor &key) {
+    return emplace(key, cbor()).first->second;
+}
+
+cbor &cbor::map::operator [] (cbor &&key) {
+    return emplace(std::move(key), cbor()).first->second;
+}
+
+std::pair<cbor::map::iterator, bool> cbor::map::insert(const value_type &item) {
+    return emplace(item.first, item.second);
+}
+
+std::pair<cbor::map::iterator, bool> cbor::map::insert(value_type &&item) {
+    return emplace(std::move(item.first), std::move(item.second));
+}
+
+std::pair<cbor::map::iterator, bool> cbor::map::emplace(cbor key, cbor value) {
+    changed();
+    iterator it = lower_bound(key);
+    if (it != m_items.end() && !(key < it->first)) {
+        return std::make_pair(it, false);
+    }
+    it = m_items.emplace(it, std::move(key), std::move(value));
+    return std::make_pair(it, true);
+}
+
+cbor::map::iterator cbor::map::erase(const_iterator position) {
+    changed();
+    return m_items.erase(m_items.begin() + (position - m_items.cbegin()));
+}
+
+size_t cbor::map::erase(const cbor &key) {
+    iterator it = find(key);
+    if (it == m_items.end()) {
+        return 0;
+    }
+    m_items.erase(it);
+    return 1;
+}
+
+bool cbor::map::operator == (const map &other) const {
+    // Differing hashes settle it without looking at the items
+    uint64_t hash = m_hash.load(std::memory_order_relaxed);
+    uint64_t other_hash = other.m_hash.load(std::memory_order_relaxed);
+    if (hash && other_hash && hash != other_hash) {
+        return false;
+    }
+    return m_items == other.m_items;
+}
+
+bool cbor::map::operator != (const map &other) const {
+    return !(*this == other);
+}
+
+uint64_t cbor::map::hash() const {
+    uint64_t result = m_hash.load(std::memory_order_relaxed);
+    if (result) {
+        return result;
+    }
+    result = combine_hash(cbor::TYPE_MAP, m_items.size());
+    for (const value_type &item : m_items) {
+        result = combine_hash(combine_hash(result, item.first.hash()), item.second.hash());
+    }
+    // 0 is reserved for a hash not computed yet
+    result = result ? result : 1;
+    m_hash.store(result, std::memory_order_relaxed);
+    return result;
+}
+
+void cbor::map::sort() {
+    changed();
+    // Encoders following RFC 8949 already emit keys in order
+    if (std::adjacent_find(m_items.begin(), m_items.end(),
+        [](const value_type &left, const value_type &right) { return !(left.first < right.first); })
+        == m_items.end()) {
+        return;
+    }
+    std::stable_sort(m_items.begin(), m_items.end(), item_less);
+    m_items.erase(std::unique(m_items.begin(), m_items.end(), same_key), m_items.end());
+}
+
+namespace {
+
+// Byte sources for cbor::read_item. Both expose the same small interface so
+// the decoder is written once: good/peek/get behave like their std::istream
+// counterparts and read/append copy a run of payload bytes in one call.
+// remaining() bounds what a header may make the decoder reserve up front.
+// Sources that keep all their bytes in memory can lend them out with borrow.
+
+// Largest run of bytes a stream is trusted for before they are read.
+const size_t stream_chunk_size = 65536;
+
+class stream_source {
+public:
+    static const bool borrows = false;
+
+    stream_source(std::istream &in, uint64_t max_bytes) : m_in(in), m_left(max_bytes) { }
+
+    bool good() const {
+        return m_in.good();
+    }
+
+    void fail() {
+        m_in.setstate(std::ios_base::failbit);
+    }
+
+    int peek() {
+        return m_in.peek();
+    }
+
+    int get() {
+        if (m_left == 0) {
+            fail();
+            return EOF;
+        }
+        --m_left;
+        return m_in.get();
+    }
+
+    bool available(uint64_t size) const {
+        return size <= m_left;
+    }
+
+    // The end of a stream is not known in advance, so containers and strings
+    // claiming more than a chunk grow as their contents actually arrive.
+    uint64_t remaining() const {
+        return std::min<uint64_t>(m_left, stream_chunk_size);
+    }
+
+    bool read(unsigned char *out, size_t size) {
+        if (size > m_left) {
+            fail();
             return false;
         }
-        item.m_type = cbor::TYPE_ARRAY;
-        item.m_array = new array;
-        if (minor == 31) {
-            while (in.good() && in.peek() != 255) {
-                cbor child;
-                child.read(in);
-                item.m_array->emplace_back(std::move(child));
-            }
-            in.get();
-        } else {
-            item.m_array->reserve(value);
-            for (uint64_t i = 0; in.good() && i != value; ++i) {
-                cbor child;
-                child.read(in);
-                item.m_array->emplace_back(std::move(child));
-            }
+        m_left -= size;
+        m_in.read(reinterpret_cast<char *>(out), size);
+        return m_in.good();
+    }
+
+    template <typename Container>
+    bool append(Container &out, uint64_t size) {
+        if (size > m_left) {
+            fail();
+            return false;
         }
-        break;
-    case 5:
-        if (minor > 27 && minor < 31) {
-            in.setstate(std::ios_base::failbit);
+        m_left -= size;
+        while (size && m_in.good()) {
+            size_t offset = out.size();
+            size_t chunk = std::min<uint64_t>(size, stream_chunk_size);
+            out.resize(offset + chunk);
+            m_in.read(reinterpret_cast<char *>(&out[offset]), chunk);
+            size -= chunk;
+        }
+        return m_in.good();
+    }
+
+    const unsigned char *borrow(uint64_t) {
+        return nullptr;
+    }
+
+private:
+    std::istream &m_in;
+    uint64_t m_left;
+};
+
+class memory_source {
+public:
+    static const bool borrows = true;
+
+    memory_source(const unsigned char *data, size_t size) : m_pos(data), m_end(data + size), m_good(true) { }
+
+    bool good() const {
+        return m_good;
+    }
+
+    void fail() {
+        m_good = false;
+    }
+
+    bool at_end() const {
+        return m_pos == m_end;
+    }
+
+    bool available(uint64_t size) const {
+        return uint64_t(m_end - m_pos) >= size;
+    }
+
+    uint64_t remaining() const {
+        return m_end - m_pos;
+    }
+
+    const unsigned char *position() const {
+        return m_pos;
+    }
+
+    int peek() {
+        if (m_pos == m_end) {
+            m_good = false;
+            return EOF;
+        }
+        return *m_pos;
+    }
+
+    int get() {
+        if (m_pos == m_end) {
+            m_good = false;
+            return EOF;
+        }
+        return *m_pos++;
+    }
+
+    bool read(unsigned char *out, size_t size) {
+        if (size_t(m_end - m_pos) < size) {
+            m_pos = m_end;
+            m_good = false;
             return false;
         }
-        item.m_type = cbor::TYPE_MAP;
-        item.m_map = new map;
-        if (minor == 31) {
-            while (in.good() && in.peek() != 255) {
-                cbor key, value;
-                key.read(in);
-                value.read(in);
-                item.m_map->emplace(key, value);
-            }
-            in.get();
-        } else {
-            for (uint64_t i = 0; in.good() && i != value; ++i) {
-                cbor key, value;
-                key.read(in);
-                value.read(in);
-                item.m_map->emplace(key, value);
+        std::memcpy(out, m_pos, size);
+        m_pos += size;
+        return true;
+    }
+
+    template <typename Container>
+    bool append(Container &out, uint64_t size) {
+        if (uint64_t(m_end - m_pos) < size) {
+            m_pos = m_end;
+            m_good = false;
+            return false;
+        }
+        out.insert(out.end(), m_pos, m_pos + size);
+        m_pos += size;
+        return true;
+    }
+
+    const unsigned char *borrow(uint64_t size) {
+        if (uint64_t(m_end - m_pos) < size) {
+            m_pos = m_end;
+            m_good = false;
+            return nullptr;
+        }
+        const unsigned char *result = m_pos;
+        m_pos += size;
+        return result;
+    }
+
+private:
+    const unsigned char *m_pos;
+    const unsigned char *m_end;
+    bool m_good;
+};
+
+template <typename Source>
+void read_uint(Source &in, int &major, int &minor, uint64_t &value) {
+    int initial = in.get();
+    major = (initial >> 5) & 7;
+    minor = initial & 31;
+    value = 0;
+    if (minor < 24) {
+        value = minor;
+        return;
+    }
+    if (minor > 27) {
+        return;
+    }
+    unsigned char bytes[8];
+    size_t size = size_t(1) << (minor - 24);
+    if (!in.read(bytes, size)) {
+        return;
+    }
+    for (size_t i = 0; i != size; ++i) {
+        value = value << 8 | bytes[i];
+    }
+}
+
+// UTF-8 validation of text strings for decode_options::strict_utf8. The
+// scalar version handles short strings and machines without SIMD; the x86
+// versions check 16 or 32 bytes per step with the lookup-table method of
+// Keiser and Lemire and are picked at runtime by what the CPU supports.
+bool valid_utf8_scalar(const unsigned char *data, size_t size) {
+    size_t i = 0;
+    while (i != size) {
+        if (size - i >= 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            if ((word & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
             }
         }
-        break;
-    case 6: {
-        if (minor > 27) {
-            in.setstate(std::ios_base::failbit);
+        unsigned char lead = data[i];
+        if (lead < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t length;
+        uint32_t code_point;
+        uint32_t minimum;
+        if ((lead & 0xe0) == 0xc0) {
+            length = 2;
+            code_point = lead & 0x1f;
+            minimum = 0x80;
+        } else if ((lead & 0xf0) == 0xe0) {
+            length = 3;
+            code_point = lead & 0x0f;
+            minimum = 0x800;
+        } else if ((lead & 0xf8) == 0xf0) {
+            length = 4;
+            code_point = lead & 0x07;
+            minimum = 0x10000;
+        } else {
             return false;
         }
-        item.m_type = cbor::TYPE_TAGGED;
-        item.m_unsigned = value;
-        item.m_array = new array;
-        cbor child;
-        child.read(in);
-        item.m_array->emplace_back(std::move(child));
-        break;
-    }
-    case 7:
-        if (minor > 27) {
-            in.setstate(std::ios_base::failbit);
+        if (size - i < length) {
             return false;
         }
-        switch (minor) {
-        case 25: {
-            item.m_type = cbor::TYPE_FLOAT;
-            int sign = value >> 15;
-            int exponent = value >> 10 & 31;
-            int significand = value & 1023;
-            if (exponent == 31) {
-                if (significand) {
-                    item.m_float = NAN;
-                } else if (sign) {
-                    item.m_float = -INFINITY;
-                } else {
-                    item.m_float = INFINITY;
-                }
-            } else if (exponent == 0) {
-                if (sign) {
-                    item.m_float = -ldexp(significand, -24);
-                } else {
-                    item.m_float = ldexp(significand, -24);
-                }
-            } else {
-                if (sign) {
-                    item.m_float = -ldexp(1024 | significand, exponent - 25);
-                } else {
-                    item.m_float = ldexp(1024 | significand, exponent - 25);
-                }
+        for (size_t k = 1; k != length; ++k) {
+            unsigned char next = data[i + k];
+            if ((next & 0xc0) != 0x80) {
+                return false;
             }
-            break;
+            code_point = code_point << 6 | (next & 0x3f);
         }
-        case 26: {
-            union {
-                float f;
-                uint32_t i;
-            };
-            i = value;
-            item.m_type = cbor::TYPE_FLOAT;
-            item.m_float = f;
-            break;
+        if (code_point < minimum || code_point > 0x10ffff || (code_point >= 0xd800 && code_point <= 0xdfff)) {
+            return false;
         }
-        case 27:
-            item.m_type = cbor::TYPE_FLOAT;
-            item.m_float = value;
-            break;
-        default:
-            item.m_type = cbor::TYPE_SIMPLE;
-            item.m_unsigned = value;
+        i += length;
+    }
+    return true;
+}
+
+#if CBOR11_X86_SIMD
+// Error classes of the lookup tables. A byte pair is invalid when every
+// table agrees on at least one class.
+enum {
+    UTF8_TOO_SHORT = 1 << 0,
+    UTF8_TOO_LONG = 1 << 1,
+    UTF8_OVERLONG_3 = 1 << 2,
+    UTF8_TOO_LARGE = 1 << 3,
+    UTF8_SURROGATE = 1 << 4,
+    UTF8_OVERLONG_2 = 1 << 5,
+    UTF8_TOO_LARGE_1000 = 1 << 6,
+    UTF8_OVERLONG_4 = 1 << 6,
+    UTF8_TWO_CONTS = 1 << 7,
+    UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS
+};
+
+// High nibble of the first byte of each pair
+#define CBOR11_UTF8_BYTE_1_HIGH \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+    UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+
+// Low nibble of the first byte of each pair
+#define CBOR11_UTF8_BYTE_1_LOW \
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+    UTF8_CARRY | UTF8_OVERLONG_2, \
+    UTF8_CARRY, \
+    UTF8_CARRY, \
+    UTF8_CARRY | UTF8_TOO_LARGE, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+// High nibble of the second byte of each pair
+#define CBOR11_UTF8_BYTE_2_HIGH \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE, \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+// Largest byte allowed in each of the last three positions of a block that
+// does not end in the middle of a sequence
+#define CBOR11_UTF8_INCOMPLETE \
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+    char(0xf0 - 1), char(0xe0 - 1), char(0xc0 - 1)
+
+__attribute__((target("ssse3")))
+bool valid_utf8_ssse3(const unsigned char *data, size_t size) {
+    const __m128i byte_1_high = _mm_setr_epi8(CBOR11_UTF8_BYTE_1_HIGH);
+    const __m128i byte_1_low = _mm_setr_epi8(CBOR11_UTF8_BYTE_1_LOW);
+    const __m128i byte_2_high = _mm_setr_epi8(CBOR11_UTF8_BYTE_2_HIGH);
+    const __m128i incomplete = _mm_setr_epi8(CBOR11_UTF8_INCOMPLETE);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();
+    __m128i previous_incomplete = _mm_setzero_si128();
+    unsigned char tail[16];
+    // The last block is padded with ASCII zeros, which also flags a sequence
+    // cut off by the end of the string
+    for (size_t offset = 0; offset <= size; offset += 16) {
+        const unsigned char *block = data + offset;
+        if (size - offset < 16) {
+            std::memset(tail, 0, sizeof(tail));
+            std::memcpy(tail, block, size - offset);
+            block = tail;
         }
-        break;
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, previous_incomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                    _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+            __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+            __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(char(0xe0 - 0x80)));
+            __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xf0 - 0x80)));
+            __m128i continuation = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(char(0x80)));
+            error = _mm_or_si128(error, _mm_xor_si128(continuation, special));
+            previous_incomplete = _mm_subs_epu8(input, incomplete);
+        }
+        previous = input;
     }
-    if (!in.good()) {
-        in.setstate(std::ios_base::failbit);
-        return false;
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+bool valid_utf8_avx2(const unsigned char *data, size_t size) {
+    const __m256i byte_1_high = _mm256_setr_epi8(CBOR11_UTF8_BYTE_1_HIGH, CBOR11_UTF8_BYTE_1_HIGH);
+    const __m256i byte_1_low = _mm256_setr_epi8(CBOR11_UTF8_BYTE_1_LOW, CBOR11_UTF8_BYTE_1_LOW);
+    const __m256i byte_2_high = _mm256_setr_epi8(CBOR11_UTF8_BYTE_2_HIGH, CBOR11_UTF8_BYTE_2_HIGH);
+    const __m256i incomplete = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        CBOR11_UTF8_INCOMPLETE);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i error = _mm256_setzero_si256();
+    __m256i previous = _mm256_setzero_si256();
+    __m256i previous_incomplete = _mm256_setzero_si256();
+    unsigned char tail[32];
+    for (size_t offset = 0; offset <= size; offset += 32) {
+        const unsigned char *block = data + offset;
+        if (size - offset < 32) {
+            std::memset(tail, 0, sizeof(tail));
+            std::memcpy(tail, block, size - offset);
+            block = tail;
+        }
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, previous_incomplete);
+        } else {
+            // Bytes shifted in from the previous block across the lane boundary
+            __m256i carried = _mm256_permute2x128_si256(previous, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+            __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+            __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xe0 - 0x80)));
+            __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xf0 - 0x80)));
+            __m256i continuation = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(char(0x80)));
+            error = _mm256_or_si256(error, _mm256_xor_si256(continuation, special));
+            previous_incomplete = _mm256_subs_epu8(input, incomplete);
+        }
+        previous = input;
     }
-    *this = item;
-    return true;
+    return _mm256_testz_si256(error, error);
 }
 
-void write_uint8(std::ostream &out, int major, uint64_t value) {
-    if (value < 24) {
-        out.put(major << 5 | value);
-    } else {
-        out.put(major << 5 | 24);
-        out.put(value);
+#undef CBOR11_UTF8_BYTE_1_HIGH
+#undef CBOR11_UTF8_BYTE_1_LOW
+#undef CBOR11_UTF8_BYTE_2_HIGH
+#undef CBOR11_UTF8_INCOMPLETE
+
+typedef bool (*utf8_validator)(const unsigned char *, size_t);
+
+utf8_validator select_utf8_validator() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return valid_utf8_avx2;
     }
+    if (__builtin_cpu_supports("ssse3")) {
+        return valid_utf8_ssse3;
+    }
+    return valid_utf8_scalar;
 }
+#endif
 
-void write_uint16(std::ostream &out, int major, uint64_t value) {
-    out.put(major << 5 | 25);
-    out.put(value >> 8);
-    out.put(value);
+bool valid_utf8(const unsigned char *data, size_t size) {
+#if CBOR11_X86_SIMD
+    // Below a block the setup costs more than the scalar loop
+    if (size >= 16) {
+        static const utf8_validator validator = select_utf8_validator();
+        return validator(data, size);
+    }
+#endif
+    return valid_utf8_scalar(data, size);
 }
 
-void write_uint32(std::ostream &out, int major, uint64_t value) {
-    out.put(major << 5 | 26);
-    out.put(value >> 24);
-    out.put(value >> 16);
-    out.put(value >> 8);
-    out.put(value);
+inline uint16_t byte_swap(uint16_t value) {
+#if defined(__GNUC__)
+    return __builtin_bswap16(value);
+#else
+    return uint16_t(value >> 8 | value << 8);
+#endif
 }
 
-void write_uint64(std::ostream &out, int major, uint64_t value) {
-    out.put(major << 5 | 27);
-    out.put(value >> 56);
-    out.put(value >> 48);
-    out.put(value >> 40);
-    out.put(value >> 32);
-    out.put(value >> 24);
-    out.put(value >> 16);
-    out.put(value >> 8);
-    out.put(value);
+inline uint32_t byte_swap(uint32_t value) {
+#if defined(__GNUC__)
+    return __builtin_bswap32(value);
+#else
+    return uint32_t(byte_swap(uint16_t(value))) << 16 | byte_swap(uint16_t(value >> 16));
+#endif
 }
 
-void write_uint(std::ostream &out, int major, uint64_t value) {
-    if ((value >> 8) == 0) {
-        write_uint8(out, major, value);
-    } else if ((value >> 16) == 0) {
-        write_uint16(out, major, value);
-    } else if (value >> 32 == 0) {
-        write_uint32(out, major, value);
-    } else {
-        write_uint64(out, major, value);
-    }
+inline uint64_t byte_swap(uint64_t value) {
+#if defined(__GNUC__)
+    return __builtin_bswap64(value);
+#else
+    return uint64_t(byte_swap(uint32_t(value))) << 32 | byte_swap(uint32_t(value >> 32));
+#endif
 }
 
-void write_float(std::ostream &out, double value) {
-    if (double(float(value)) == value) {
-        union {
-            float f;
-            uint32_t i;
-        };
-        f = value;
-        write_uint32(out, 7, i);
-    } else {
-        union {
-            double f;
-            uint64_t i;
-        };
-        f = value;
-        write_uint64(out, 7, i);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+const bool host_little_endian = false;
+#else
+const bool host_little_endian = true;
+#endif
+
+// Reverses the bytes of each of the width byte elements in data, for typed
+// arrays stored in the other byte order. The x86 versions shuffle 16 or 32
+// bytes per step and are picked at runtime like the UTF-8 validators.
+template <typename Word>
+void swap_words(unsigned char *data, size_t size) {
+    for (; size >= sizeof(Word); data += sizeof(Word), size -= sizeof(Word)) {
+        Word word;
+        std::memcpy(&word, data, sizeof(word));
+        word = byte_swap(word);
+        std::memcpy(data, &word, sizeof(word));
     }
 }
 
-void cbor::write(std::ostream &out) const {
-    switch (this->m_type) {
-    case cbor::TYPE_UNSIGNED:
-        write_uint(out, 0, m_unsigned);
-        break;
-    case cbor::TYPE_NEGATIVE:
-        write_uint(out, 1, m_integer);
-        break;
-    case cbor::TYPE_BINARY:
-        write_uint(out, 2, m_binary->size());
-        out.write(reinterpret_cast<const char *>(m_binary->data()), m_binary->size());
-        break;
-    case cbor::TYPE_STRING:
-        write_uint(out, 3, m_string->size());
-        out.write(m_string->c_str(), m_string->size());
-        break;
-    case cbor::TYPE_ARRAY:
-        write_uint(out, 4, m_array->size());
-        for(const auto& e : *m_array) {
-            e.write(out);
-        }
-        break;
-    case cbor::TYPE_MAP:
-        write_uint(out, 5, m_map->size());
-        for(auto&& e : *m_map) {
-            e.first.write(out);
-            e.second.write(out);
-        }
-        break;
-    case cbor::TYPE_TAGGED:
-        write_uint(out, 6, m_unsigned);
-        m_array->front().write(out);
+void swap_bytes_scalar(unsigned char *data, size_t size, size_t width) {
+    switch (width) {
+    case 2:
+        swap_words<uint16_t>(data, size);
         break;
-    case cbor::TYPE_SIMPLE:
-        write_uint8(out, 7, m_unsigned);
+    case 4:
+        swap_words<uint32_t>(data, size);
         break;
-    case cbor::TYPE_FLOAT:
-        write_float(out, m_float);
+    case 8:
+        swap_words<uint64_t>(data, size);
         break;
     }
 }
 
-bool cbor::validate(const cbor::binary &in) {
-    std::istringstream buf1(std::string(in.begin(), in.end()));
-    cbor buf2;
-    return buf2.read(buf1) && buf1.peek() == EOF;
-}
+#if CBOR11_X86_SIMD
 
-cbor cbor::decode(const cbor::binary &in) {
-    std::istringstream buf1(std::string(in.begin(), in.end()));
-    cbor buf2;
-    if (buf2.read(buf1) && buf1.peek() == EOF) {
-        return buf2;
+__attribute__((target("ssse3")))
+__m128i swap_mask(size_t width) {
+    unsigned char order[16];
+    for (size_t i = 0; i != 16; ++i) {
+        order[i] = i / width * width + width - 1 - i % width;
     }
-    return cbor();
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(order));
 }
 
-cbor::binary cbor::encode(const cbor &in) {
-    std::ostringstream buf1;
-    in.write(buf1);
-    std::string buf2 = buf1.str();
-    return cbor::binary(buf2.begin(), buf2.end());
+__attribute__((target("ssse3")))
+void swap_bytes_ssse3(unsigned char *data, size_t size, size_t width) {
+    const __m128i mask = swap_mask(width);
+    size_t offset = 0;
+    for (; offset + 16 <= size; offset += 16) {
+        __m128i *block = reinterpret_cast<__m128i *>(data + offset);
+        _mm_storeu_si128(block, _mm_shuffle_epi8(_mm_loadu_si128(block), mask));
+    }
+    swap_bytes_scalar(data + offset, size - offset, width);
 }
 
-cbor::string cbor::debug(const cbor &in) {
-    std::ostringstream out;
-    switch (in.m_type) {
-    case cbor::TYPE_UNSIGNED:
-        out << in.m_unsigned;
-        break;
-    case cbor::TYPE_NEGATIVE:
-        if (1 + in.m_integer == 0) {
-            out << "-18446744073709551616";
+__attribute__((target("avx2")))
+void swap_bytes_avx2(unsigned char *data, size_t size, size_t width) {
+    const __m256i mask = _mm256_broadcastsi128_si256(swap_mask(width));
+    size_t offset = 0;
+    for (; offset + 32 <= size; offset += 32) {
+        __m256i *block = reinterpret_cast<__m256i *>(data + offset);
+        _mm256_storeu_si256(block, _mm256_shuffle_epi8(_mm256_loadu_si256(block), mask));
+    }
+    swap_bytes_scalar(data + offset, size - offset, width);
+}
+
+typedef void (*swap_bytes_function)(unsigned char *, size_t, size_t);
+
+swap_bytes_function select_swap_bytes() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return swap_bytes_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return swap_bytes_ssse3;
+    }
+    return swap_bytes_scalar;
+}
+
+#endif
+
+void swap_bytes(unsigned char *data, size_t size, size_t width) {
+#if CBOR11_X86_SIMD
+    if (size >= 16) {
+        static const swap_bytes_function function = select_swap_bytes();
+        function(data, size, width);
+        return;
+    }
+#endif
+    swap_bytes_scalar(data, size, width);
+}
+
+// RFC 8746 typed array tags are 0b010fsell: float, signed, little endian
+// and a size field l of 1 to 8 bytes for integers or 2 to 16 for floats.
+// Single bytes use the e bit for the clamped uint8 variant instead.
+size_t typed_array_width(uint64_t tag) {
+    if (tag < 64 || tag > 87) {
+        return 0;
+    }
+    return (tag & 16 ? 2 : 1) << (tag & 3);
+}
+
+bool typed_array_little_endian(uint64_t tag) {
+    return typed_array_width(tag) > 1 && (tag & 4);
+}
+
+// Big-endian tag and host-order tag of each element type typed_array takes.
+template <typename Type> struct typed_array_tag;
+template <> struct typed_array_tag<uint8_t> { static const uint64_t big = 64; };
+template <> struct typed_array_tag<uint16_t> { static const uint64_t big = 65; };
+template <> struct typed_array_tag<uint32_t> { static const uint64_t big = 66; };
+template <> struct typed_array_tag<uint64_t> { static const uint64_t big = 67; };
+template <> struct typed_array_tag<int8_t> { static const uint64_t big = 72; };
+template <> struct typed_array_tag<int16_t> { static const uint64_t big = 73; };
+template <> struct typed_array_tag<int32_t> { static const uint64_t big = 74; };
+template <> struct typed_array_tag<int64_t> { static const uint64_t big = 75; };
+template <> struct typed_array_tag<float> { static const uint64_t big = 81; };
+template <> struct typed_array_tag<double> { static const uint64_t big = 82; };
+
+template <typename Type>
+uint64_t host_typed_array_tag() {
+    return typed_array_tag<Type>::big + (host_little_endian && sizeof(Type) > 1 ? 4 : 0);
+}
+
+// Reads the payload of a byte or text string into the arena and returns it,
+// concatenating the chunks of an indefinite-length string. Strings longer
+// than the source can vouch for are gathered first, so a header alone never
+// takes arena space.
+template <typename Source>
+const unsigned char *read_payload(Source &in, int major, int minor, uint64_t &size, const cbor::decode_options &options) {
+    bool check_utf8 = major == 3 && options.strict_utf8;
+    if (minor != 31 && size <= in.remaining()) {
+        // Byte strings are aligned for typed arrays to be read in place
+        unsigned char *out = static_cast<unsigned char *>(options.arena->allocate(size, major == 2 ? 8 : 1));
+        if (in.read(out, size) && check_utf8 && !valid_utf8(out, size)) {
+            in.fail();
+            return nullptr;
+        }
+        return out;
+    }
+    std::string chunks;
+    if (minor != 31) {
+        if (!in.append(chunks, size)
+            || (check_utf8 && !valid_utf8(reinterpret_cast<const unsigned char *>(chunks.data()), size))) {
+            in.fail();
+            return nullptr;
+        }
+    } else {
+        int chunk_major, chunk_minor;
+        uint64_t chunk_size;
+        while (in.good() && in.peek() != 255) {
+            read_uint(in, chunk_major, chunk_minor, chunk_size);
+            if (chunk_major != major || chunk_minor > 27 || chunk_size > options.max_string_length - chunks.size()) {
+                in.fail();
+                return nullptr;
+            }
+            CBOR11_COUNT(options.stats, indefinite_chunks, 1);
+            size_t offset = chunks.size();
+            if (in.append(chunks, chunk_size) && check_utf8
+                && !valid_utf8(reinterpret_cast<const unsigned char *>(chunks.data()) + offset, chunk_size)) {
+                in.fail();
+                return nullptr;
+            }
+        }
+        in.get();
+    }
+    if (!in.good()) {
+        return nullptr;
+    }
+    size = chunks.size();
+    unsigned char *out = static_cast<unsigned char *>(options.arena->allocate(size, major == 2 ? 8 : 1));
+    std::memcpy(out, chunks.data(), size);
+    return out;
+}
+
+// Converts the argument of a major type 7 half, single or double header.
+double decode_float(int minor, uint64_t value) {
+    switch (minor) {
+    case 25: {
+        int sign = value >> 15;
+        int exponent = value >> 10 & 31;
+        int significand = value & 1023;
+        double magnitude;
+        if (exponent == 31) {
+            if (significand) {
+                return NAN;
+            }
+            magnitude = INFINITY;
+        } else if (exponent == 0) {
+            magnitude = ldexp(significand, -24);
         } else {
-            out << "-" << 1 + in.m_integer;
+            magnitude = ldexp(1024 | significand, exponent - 25);
+        }
+        return sign ? -magnitude : magnitude;
+    }
+    case 26: {
+        union {
+            float f;
+            uint32_t i;
+        };
+        i = value;
+        return f;
+    }
+    default: {
+        union {
+            double f;
+            uint64_t i;
+        };
+        i = value;
+        return f;
+    }
+    }
+}
+
+template <typename Type>
+Type *construct(cbor::arena *arena) {
+    if (arena) {
+        return new (arena->allocate(sizeof(Type), alignof(Type))) Type;
+    }
+    return new_payload<Type>();
+}
+
+} // namespace
+
+template <typename Source>
+bool cbor::read_item(Source &in, const cbor::decode_options &options, uint64_t &nodes, size_t depth, bool key) {
+    cbor::arena *arena = options.arena;
+    bool borrowing = !arena && (options.borrow || options.intern);
+    if (depth > options.max_depth || nodes == options.max_nodes) {
+        in.fail();
+        return false;
+    }
+    ++nodes;
+    cbor item;
+    int major, minor;
+    uint64_t value;
+    read_uint(in, major, minor, value);
+    switch (major) {
+    case 0:
+        if (minor > 27) {
+            in.fail();
+            return false;
         }
+        item.m_type = cbor::TYPE_UNSIGNED;
+        item.m_unsigned = value;
         break;
-    case cbor::TYPE_BINARY:
-        out << "h'";
-        out << std::hex;
-        out.fill('0');
-        for(auto e : *in.m_binary) {
-            out.width(2);
-            out << int(e);
+    case 1:
+        if (minor > 27) {
+            in.fail();
+            return false;
         }
-        out << "'";
+        item.m_type = cbor::TYPE_NEGATIVE;
+        item.m_integer = value;
         break;
-    case cbor::TYPE_STRING:
-        out << "\"";
-        out << std::hex;
-        out.fill('0');
-        for(auto e : *in.m_string) {
-            switch (e) {
-            case '\n':
-                out << "\\n";
-                break;
-            case '\r':
-                out << "\\r";
-                break;
-            case '\"':
-                out << "\\\"";
-                break;
-            case '\\':
-                out << "\\\\";
-                break;
-            default:
-                if ((unsigned char)e < '\x20') {
-                    out << "\\u";
-                    out.width(4);
-                    out << (int) (unsigned char)e;
-                } else {
-                    out << e;
+    case 2:
+        if ((minor > 27 && minor < 31) || (minor != 31 && value > options.max_string_length)) {
+            in.fail();
+            return false;
+        }
+        item.m_type = cbor::TYPE_BINARY;
+        if (minor != 31 && value <= inline_capacity) {
+            item.m_storage = STORAGE_INLINE;
+            item.m_inline_size = value;
+            in.read(item.inline_bytes(), value);
+            break;
+        }
+        if (Source::borrows && options.borrow && minor != 31) {
+            item.m_storage = STORAGE_BORROWED;
+            item.m_bytes = in.borrow(value);
+            item.m_unsigned = value;
+            break;
+        }
+        if (arena) {
+            item.m_storage = STORAGE_BORROWED;
+            item.m_bytes = read_payload(in, major, minor, value, options);
+            item.m_unsigned = value;
+            break;
+        }
+        item.m_binary = new_payload<binary>();
+        if (minor == 31) {
+            while (in.good() && in.peek() != 255) {
+                read_uint(in, major, minor, value);
+                if (major != 2 || minor > 27 || value > options.max_string_length - item.m_binary->size()) {
+                    in.fail();
+                    return false;
                 }
-                break;
+                CBOR11_COUNT(options.stats, indefinite_chunks, 1);
+                in.append(*item.m_binary, value);
             }
+            in.get();
+        } else {
+            in.append(*item.m_binary, value);
         }
-        out << "\"";
         break;
-    case cbor::TYPE_ARRAY:
-        out << "[";
-        for (cbor::array::const_iterator it = (*in.m_array).begin(); it != (*in.m_array).end(); ++it) {
-            if (it != in.m_array->begin()) {
-                out << ", ";
-            }
-            out << cbor::debug(*it);
+    case 3:
+        if ((minor > 27 && minor < 31) || (minor != 31 && value > options.max_string_length)) {
+            in.fail();
+            return false;
         }
-        out << "]";
-        break;
-    case cbor::TYPE_MAP:
-        out << "{";
-        for (cbor::map::const_iterator it = (*in.m_map).begin(); it != (*in.m_map).end(); ++it) {
-            if (it != in.m_map->begin()) {
-                out << ", ";
+        // Map keys too long for their node are shared through the table
+        // where one is given, and otherwise stored as other strings are
+        if (key && options.intern && minor != 31 && value > inline_capacity && value <= intern_table::max_length) {
+            unsigned char buffer[intern_table::max_length];
+            const unsigned char *text = Source::borrows ? in.borrow(value) : in.read(buffer, value) ? buffer : nullptr;
+            if (!text || (options.strict_utf8 && !valid_utf8(text, value))) {
+                in.fail();
+                return false;
+            }
+            item.m_type = cbor::TYPE_STRING;
+            const unsigned char *shared = options.intern->intern(text, value);
+            if (!shared && Source::borrows && options.borrow) {
+                shared = text;
+            } else if (!shared && arena) {
+                unsigned char *copy = static_cast<unsigned char *>(arena->allocate(value, 1));
+                std::memcpy(copy, text, value);
+                shared = copy;
+            }
+            if (shared) {
+                item.m_storage = STORAGE_BORROWED;
+                item.m_bytes = shared;
+                item.m_unsigned = value;
+            } else {
+                item.assign_bytes(text, value);
             }
-            out << cbor::debug(it->first) << ": " << cbor::debug(it->second);
-        }
-        out << "}";
-        break;
-    case cbor::TYPE_TAGGED:
-        out << in.m_unsigned << "(" << cbor::debug(in.m_array->front()) << ")";
-        break;
-    case cbor::TYPE_SIMPLE:
-        switch (in.m_unsigned) {
-        case cbor::SIMPLE_FALSE:
-            out << "false";
-            break;
-        case cbor::SIMPLE_TRUE:
-            out << "true";
             break;
-        case cbor::SIMPLE_NULL:
-            out << "null";
+        }
+        item.m_type = cbor::TYPE_STRING;
+        if (minor != 31 && value <= inline_capacity) {
+            item.m_storage = STORAGE_INLINE;
+            item.m_inline_size = value;
+            if (in.read(item.inline_bytes(), value) && options.strict_utf8 && !valid_utf8(item.inline_bytes(), value)) {
+                in.fail();
+                return false;
+            }
             break;
-        case cbor::SIMPLE_UNDEFINED:
-            out << "undefined";
+        }
+        if (Source::borrows && options.borrow && minor != 31) {
+            item.m_storage = STORAGE_BORROWED;
+            item.m_bytes = in.borrow(value);
+            item.m_unsigned = value;
+            if (item.m_bytes && options.strict_utf8 && !valid_utf8(item.m_bytes, value)) {
+                in.fail();
+                return false;
+            }
             break;
-        default:
-            out << "simple(" << in.m_unsigned << ")";
+        }
+        if (arena) {
+            item.m_storage = STORAGE_BORROWED;
+            item.m_bytes = read_payload(in, major, minor, value, options);
+            item.m_unsigned = value;
             break;
         }
+        item.m_string = new_payload<string>();
+        if (minor == 31) {
+            while (in.good() && in.peek() != 255) {
+                read_uint(in, major, minor, value);
+                if (major != 3 || minor > 27 || value > options.max_string_length - item.m_string->size()) {
+                    in.fail();
+                    return false;
+                }
+                CBOR11_COUNT(options.stats, indefinite_chunks, 1);
+                size_t offset = item.m_string->size();
+                if (in.append(*item.m_string, value) && options.strict_utf8
+                    && !valid_utf8(reinterpret_cast<const unsigned char *>(item.m_string->data()) + offset, value)) {
+                    in.fail();
+                    return false;
+                }
+            }
+            in.get();
+        } else if (in.append(*item.m_string, value) && options.strict_utf8
+            && !valid_utf8(reinterpret_cast<const unsigned char *>(item.m_string->data()), value)) {
+            in.fail();
+            return false;
+        }
         break;
-    case cbor::TYPE_FLOAT:
-        if (std::isinf(in.m_float)) {
-            if (in.m_float < 0) {
-                out << "-";
+    case 4:
+        if ((minor > 27 && minor < 31) || (minor != 31 && value > options.max_items)) {
+            in.fail();
+            return false;
+        }
+        item.m_type = cbor::TYPE_ARRAY;
+        item.m_storage = arena ? STORAGE_ARENA : STORAGE_HEAP;
+        item.m_borrowing = borrowing;
+        item.m_array = construct<array>(arena);
+        if (minor == 31) {
+            while (in.good() && in.peek() != 255) {
+                if (item.m_array->size() == options.max_items) {
+                    in.fail();
+                    return false;
+                }
+                CBOR11_COUNT(options.stats, indefinite_chunks, 1);
+                cbor child;
+                child.read_item(in, options, nodes, depth + 1);
+                item.m_array->emplace_back(std::move(child));
             }
-            out << "Infinity";
-        } else if (std::isnan(in.m_float)) {
-            out << "NaN";
+            in.get();
         } else {
-            out << std::showpoint << in.m_float;
+            // Every item takes at least a byte, so the count in the header
+            // is only trusted as far as the input goes
+            item.m_array->reserve(std::min(value, in.remaining()));
+            for (uint64_t i = 0; in.good() && i != value; ++i) {
+                cbor child;
+                child.read_item(in, options, nodes, depth + 1);
+                item.m_array->emplace_back(std::move(child));
+            }
+        }
+        break;
+    case 5:
+        if ((minor > 27 && minor < 31) || (minor != 31 && value > options.max_items)) {
+            in.fail();
+            return false;
+        }
+        item.m_type = cbor::TYPE_MAP;
+        item.m_storage = arena ? STORAGE_ARENA : STORAGE_HEAP;
+        item.m_borrowing = borrowing;
+        item.m_map = construct<map>(arena);
+        // Pairs are appended as they come and put in order once at the end
+        if (minor == 31) {
+            while (in.good() && in.peek() != 255) {
+                if (item.m_map->m_items.size() == options.max_items) {
+                    in.fail();
+                    return false;
+                }
+                CBOR11_COUNT(options.stats, indefinite_chunks, 1);
+                item.m_map->m_items.emplace_back();
+                item.m_map->m_items.back().first.read_item(in, options, nodes, depth + 1, true);
+                item.m_map->m_items.back().second.read_item(in, options, nodes, depth + 1);
+            }
+            in.get();
+        } else {
+            item.m_map->m_items.reserve(std::min(value, in.remaining() / 2));
+            for (uint64_t i = 0; in.good() && i != value; ++i) {
+                item.m_map->m_items.emplace_back();
+                item.m_map->m_items.back().first.read_item(in, options, nodes, depth + 1, true);
+                item.m_map->m_items.back().second.read_item(in, options, nodes, depth + 1);
+            }
+        }
+        item.m_map->sort();
+        break;
+    case 6: {
+        if (minor > 27) {
+            in.fail();
+            return false;
         }
+        item.m_type = cbor::TYPE_TAGGED;
+        item.m_unsigned = value;
+        item.m_storage = arena ? STORAGE_ARENA : STORAGE_HEAP;
+        item.m_borrowing = borrowing;
+        item.m_child = construct<cbor>(arena);
+        item.m_child->read_item(in, options, nodes, depth + 1);
+        item.typed_array_to_host(options.borrow);
         break;
     }
-    return out.str();
+    case 7:
+        if (minor > 27 || (minor == 24 && value < 32)) {
+            in.fail();
+            return false;
+        }
+        switch (minor) {
+        case 25:
+        case 26:
+        case 27:
+            item.m_type = cbor::TYPE_FLOAT;
+            item.m_float = decode_float(minor, value);
+            break;
+        default:
+            item.m_type = cbor::TYPE_SIMPLE;
+            item.m_unsigned = value;
+        }
+        break;
+    }
+    if (!in.good()) {
+        in.fail();
+        return false;
+    }
+#if CBOR11_STATS
+    if (cbor::stats *stats = options.stats) {
+        size_t allocations = 0;
+        size_t heap_bytes = 0;
+        item.payload_memory(allocations, heap_bytes);
+        ++stats->nodes[item.m_type];
+        stats->allocations += allocations;
+        stats->allocated_bytes += heap_bytes;
+        stats->max_depth = std::max<uint64_t>(stats->max_depth, depth);
+    }
+#endif
+    *this = std::move(item);
+    return true;
 }
 
-void cbor::destroy()
-{
-    switch(m_type)
-    {
-        case TYPE_BINARY:
-            delete m_binary;
-            m_binary = nullptr;
-            break;
-        case TYPE_STRING:
-            delete m_string;
-            m_string = nullptr;
+// Brings a decoded typed array into host byte order. Arrays with a partial
+// last element, and the float128 ones, are left as they came. Bytes that
+// may be borrowed from the input are copied before they are swapped, or if
+// they are not aligned for to_span.
+void cbor::typed_array_to_host(bool borrowed) {
+    size_t width = typed_array_width(m_unsigned);
+    if (width < 2 || width > 8 || m_child->m_type != cbor::TYPE_BINARY || m_child->bytes_size() % width != 0) {
+        return;
+    }
+    bool swap = typed_array_little_endian(m_unsigned) != host_little_endian;
+    const unsigned char *bytes = m_child->bytes_data();
+    if (borrowed && m_child->m_storage == STORAGE_BORROWED
+        && (swap || reinterpret_cast<uintptr_t>(bytes) % width != 0)) {
+        *m_child = cbor(cbor::binary(bytes, bytes + m_child->bytes_size()));
+    }
+    if (swap) {
+        // The bytes were allocated by this decode, wherever they live
+        swap_bytes(const_cast<unsigned char *>(m_child->bytes_data()), m_child->bytes_size(), width);
+        m_unsigned ^= 4;
+    }
+}
+
+template <typename Type>
+cbor cbor::typed_array(const Type *data, size_t count) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    return tagged(host_typed_array_tag<Type>(), cbor::binary(bytes, bytes + count * sizeof(Type)));
+}
+
+template <typename Type>
+cbor::span<Type> cbor::to_span() const {
+    if (m_type != cbor::TYPE_TAGGED || m_child->m_type != cbor::TYPE_BINARY) {
+        return span<Type>();
+    }
+    // The clamped variant holds plain uint8_t as well
+    if (m_unsigned != host_typed_array_tag<Type>() && !(m_unsigned == 68 && host_typed_array_tag<Type>() == 64)) {
+        return span<Type>();
+    }
+    size_t size = m_child->bytes_size();
+    if (size % sizeof(Type) != 0) {
+        return span<Type>();
+    }
+    return span<Type>(reinterpret_cast<const Type *>(m_child->bytes_data()), size / sizeof(Type));
+}
+
+template cbor cbor::typed_array(const uint8_t *, size_t);
+template cbor cbor::typed_array(const uint16_t *, size_t);
+template cbor cbor::typed_array(const uint32_t *, size_t);
+template cbor cbor::typed_array(const uint64_t *, size_t);
+template cbor cbor::typed_array(const int8_t *, size_t);
+template cbor cbor::typed_array(const int16_t *, size_t);
+template cbor cbor::typed_array(const int32_t *, size_t);
+template cbor cbor::typed_array(const int64_t *, size_t);
+template cbor cbor::typed_array(const float *, size_t);
+template cbor cbor::typed_array(const double *, size_t);
+template cbor::span<uint8_t> cbor::to_span() const;
+template cbor::span<uint16_t> cbor::to_span() const;
+template cbor::span<uint32_t> cbor::to_span() const;
+template cbor::span<uint64_t> cbor::to_span() const;
+template cbor::span<int8_t> cbor::to_span() const;
+template cbor::span<int16_t> cbor::to_span() const;
+template cbor::span<int32_t> cbor::to_span() const;
+template cbor::span<int64_t> cbor::to_span() const;
+template cbor::span<float> cbor::to_span() const;
+template cbor::span<double> cbor::to_span() const;
+
+bool cbor::read(std::istream &in) {
+    return read(in, decode_options());
+}
+
+namespace {
+
+// Adds the time and arena space taken by one top-level call to its stats.
+class stats_scope {
+public:
+#if CBOR11_STATS
+    stats_scope(cbor::stats *stats, cbor::arena *arena) : m_stats(stats), m_arena(arena),
+        m_arena_bytes(arena ? arena->bytes_allocated() : 0), m_start(std::chrono::steady_clock::now()) { }
+
+    ~stats_scope() {
+        if (m_stats) {
+            m_stats->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+            if (m_arena) {
+                m_stats->arena_bytes += m_arena->bytes_allocated() - m_arena_bytes;
+            }
+        }
+    }
+
+    void add_bytes(uint64_t bytes) {
+        if (m_stats) {
+            m_stats->bytes += bytes;
+        }
+    }
+
+private:
+    cbor::stats *m_stats;
+    cbor::arena *m_arena;
+    size_t m_arena_bytes;
+    std::chrono::steady_clock::time_point m_start;
+#else
+    stats_scope(cbor::stats *, cbor::arena *) { }
+
+    void add_bytes(uint64_t) { }
+#endif
+};
+
+} // namespace
+
+bool cbor::read(std::istream &in, const cbor::decode_options &options) {
+    stats_scope scope(options.stats, options.arena);
+    std::istream::pos_type start = in.tellg();
+    stream_source source(in, options.max_bytes);
+    uint64_t nodes = 0;
+    bool result = read_item(source, options, nodes, 0);
+    std::istream::pos_type end = in.tellg();
+    if (start != std::istream::pos_type(-1) && end != std::istream::pos_type(-1)) {
+        scope.add_bytes(end - start);
+    }
+    return result;
+}
+
+cbor::decode_options::decode_options() : arena(nullptr), strict_utf8(false), borrow(false), stats(nullptr),
+    intern(nullptr), max_depth(2048),
+    max_bytes(UINT64_MAX), max_items(UINT64_MAX), max_string_length(UINT64_MAX), max_nodes(UINT64_MAX) { }
+
+cbor::stats::stats() : allocations(0), allocated_bytes(0), arena_bytes(0), max_depth(0), indefinite_chunks(0),
+    bytes(0), seconds(0) {
+    std::fill(nodes, nodes + sizeof(nodes) / sizeof(nodes[0]), 0);
+}
+
+namespace {
+
+template <typename Type>
+inline Type to_big_endian(Type value) {
+    return host_little_endian ? byte_swap(value) : value;
+}
+
+// Byte sinks for cbor::write_item, mirroring the sources used for reading.
+class stream_sink {
+public:
+    explicit stream_sink(std::ostream &out) : m_out(out) { }
+
+    void put(unsigned char value) {
+        m_out.put(value);
+    }
+
+    void write(const void *data, size_t size) {
+        m_out.write(static_cast<const char *>(data), size);
+    }
+
+private:
+    std::ostream &m_out;
+};
+
+// Appends to a growing buffer, for writers that cannot size their output first.
+class vector_sink {
+public:
+    explicit vector_sink(cbor::binary &out) : m_out(out) { }
+
+    void put(unsigned char value) {
+        m_out.push_back(value);
+    }
+
+    void write(const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        m_out.insert(m_out.end(), bytes, bytes + size);
+    }
+
+private:
+    cbor::binary &m_out;
+};
+
+// Writes into memory the caller has already sized with cbor::encoded_size.
+class buffer_sink {
+public:
+    explicit buffer_sink(unsigned char *out) : m_pos(out) { }
+
+    void put(unsigned char value) {
+        *m_pos++ = value;
+    }
+
+    void write(const void *data, size_t size) {
+        // Empty strings may have no storage at all, and memcpy takes no null
+        if (size == 0) {
+            return;
+        }
+        std::memcpy(m_pos, data, size);
+        m_pos += size;
+    }
+
+private:
+    unsigned char *m_pos;
+};
+
+// Each header is assembled in a small array (initial byte followed by the
+// big-endian argument stored in one go) and handed to the sink as a unit.
+template <typename Type>
+struct header {
+    unsigned char initial;
+    unsigned char argument[sizeof(Type)];
+};
+
+template <typename Type, typename Sink>
+void write_header(Sink &out, int major, int minor, Type value) {
+    header<Type> bytes;
+    bytes.initial = major << 5 | minor;
+    value = to_big_endian(value);
+    std::memcpy(bytes.argument, &value, sizeof(value));
+    out.write(&bytes, sizeof(bytes));
+}
+
+template <typename Sink>
+void write_uint8(Sink &out, int major, uint64_t value) {
+    if (value < 24) {
+        out.put(major << 5 | value);
+    } else {
+        unsigned char bytes[2] = { static_cast<unsigned char>(major << 5 | 24), static_cast<unsigned char>(value) };
+        out.write(bytes, sizeof(bytes));
+    }
+}
+
+template <typename Sink>
+void write_uint16(Sink &out, int major, uint64_t value) {
+    write_header<uint16_t>(out, major, 25, value);
+}
+
+template <typename Sink>
+void write_uint32(Sink &out, int major, uint64_t value) {
+    write_header<uint32_t>(out, major, 26, value);
+}
+
+template <typename Sink>
+void write_uint64(Sink &out, int major, uint64_t value) {
+    write_header<uint64_t>(out, major, 27, value);
+}
+
+template <typename Sink>
+void write_uint(Sink &out, int major, uint64_t value) {
+    if ((value >> 8) == 0) {
+        write_uint8(out, major, value);
+    } else if ((value >> 16) == 0) {
+        write_uint16(out, major, value);
+    } else if (value >> 32 == 0) {
+        write_uint32(out, major, value);
+    } else {
+        write_uint64(out, major, value);
+    }
+}
+
+template <typename Sink>
+void write_float(Sink &out, double value) {
+    if (double(float(value)) == value) {
+        union {
+            float f;
+            uint32_t i;
+        };
+        f = value;
+        write_uint32(out, 7, i);
+    } else {
+        union {
+            double f;
+            uint64_t i;
+        };
+        f = value;
+        write_uint64(out, 7, i);
+    }
+}
+
+// Encoded sizes matching the choices made by write_uint and write_float.
+size_t uint_size(uint64_t value) {
+    if (value < 24) {
+        return 1;
+    } else if ((value >> 8) == 0) {
+        return 2;
+    } else if ((value >> 16) == 0) {
+        return 3;
+    } else if (value >> 32 == 0) {
+        return 5;
+    }
+    return 9;
+}
+
+size_t float_size(double value) {
+    return double(float(value)) == value ? 5 : 9;
+}
+
+} // namespace
+
+template <typename Sink>
+void cbor::write_item(Sink &out) const {
+    switch (this->m_type) {
+    case cbor::TYPE_UNSIGNED:
+        write_uint(out, 0, m_unsigned);
+        break;
+    case cbor::TYPE_NEGATIVE:
+        write_uint(out, 1, m_integer);
+        break;
+    case cbor::TYPE_BINARY:
+        write_uint(out, 2, bytes_size());
+        out.write(bytes_data(), bytes_size());
+        break;
+    case cbor::TYPE_STRING:
+        write_uint(out, 3, bytes_size());
+        out.write(bytes_data(), bytes_size());
+        break;
+    case cbor::TYPE_ARRAY:
+        write_uint(out, 4, m_array->size());
+        for(const auto& e : *m_array) {
+            e.write_item(out);
+        }
+        break;
+    case cbor::TYPE_MAP:
+        write_uint(out, 5, m_map->size());
+        for(auto&& e : *m_map) {
+            e.first.write_item(out);
+            e.second.write_item(out);
+        }
+        break;
+    case cbor::TYPE_TAGGED:
+        write_uint(out, 6, m_unsigned);
+        m_child->write_item(out);
+        break;
+    case cbor::TYPE_SIMPLE:
+        write_uint8(out, 7, m_unsigned);
+        break;
+    case cbor::TYPE_FLOAT:
+        write_float(out, m_float);
+        break;
+    }
+}
+
+void cbor::write(std::ostream &out) const {
+    stream_sink sink(out);
+    write_item(sink);
+}
+
+size_t cbor::encoded_size(const cbor &in) {
+    switch (in.m_type) {
+    case cbor::TYPE_UNSIGNED:
+        return uint_size(in.m_unsigned);
+    case cbor::TYPE_NEGATIVE:
+        return uint_size(in.m_integer);
+    case cbor::TYPE_BINARY:
+    case cbor::TYPE_STRING:
+        return uint_size(in.bytes_size()) + in.bytes_size();
+    case cbor::TYPE_ARRAY: {
+        size_t size = uint_size(in.m_array->size());
+        for(const auto& e : *in.m_array) {
+            size += encoded_size(e);
+        }
+        return size;
+    }
+    case cbor::TYPE_MAP: {
+        size_t size = uint_size(in.m_map->size());
+        for(auto&& e : *in.m_map) {
+            size += encoded_size(e.first) + encoded_size(e.second);
+        }
+        return size;
+    }
+    case cbor::TYPE_TAGGED:
+        return uint_size(in.m_unsigned) + encoded_size(*in.m_child);
+    case cbor::TYPE_SIMPLE:
+        return in.m_unsigned < 24 ? 1 : 2;
+    case cbor::TYPE_FLOAT:
+        return float_size(in.m_float);
+    }
+    return 0;
+}
+
+namespace {
+
+// Parses the header of the item at pos. Returns the position just past the
+// header, or nullptr if it is truncated or uses a reserved minor value.
+const unsigned char *parse_header(const unsigned char *pos, const unsigned char *end, int &major, int &minor,
+    uint64_t &value) {
+    if (pos == end) {
+        return nullptr;
+    }
+    major = *pos >> 5;
+    minor = *pos & 31;
+    ++pos;
+    value = 0;
+    if (minor < 24) {
+        value = minor;
+        return pos;
+    }
+    if (minor > 27) {
+        return minor == 31 ? pos : nullptr;
+    }
+    size_t size = size_t(1) << (minor - 24);
+    if (size_t(end - pos) < size) {
+        return nullptr;
+    }
+    for (size_t i = 0; i != size; ++i) {
+        value = value << 8 | pos[i];
+    }
+    return pos + size;
+}
+
+// Where parse_header failed: at the header itself for a reserved minor value,
+// otherwise at the end of the input it ran into.
+const unsigned char *header_error(const unsigned char *start, const unsigned char *end) {
+    if (start != end && (*start & 31) > 27 && (*start & 31) < 31) {
+        return start;
+    }
+    return end;
+}
+
+// Nesting of indefinite-length containers scan_item can follow. Definite
+// containers need no bookkeeping of their own, so only these use stack space.
+const size_t max_indefinite_depth = 128;
+
+// Returns the end of the item starting at pos without decoding it, or nullptr
+// if the item is truncated or not well-formed, in which case error is set to
+// the header at fault or, for truncation, to end. Items still owed by definite
+// containers are folded into a single counter, so the only state kept per
+// nesting level is for indefinite-length arrays and maps and nothing is
+// allocated. Where nodes is given, the items met, as decoding counts them
+// against max_nodes, are added to it.
+const unsigned char *scan_item(const unsigned char *pos, const unsigned char *end, const unsigned char *&error,
+    bool strict_utf8, uint64_t *nodes = nullptr) {
+    struct frame {
+        uint64_t pending;
+        bool map;
+        bool odd;
+    };
+    frame frames[max_indefinite_depth];
+    size_t depth = 0;
+    uint64_t pending = 1;
+    while (true) {
+        if (pending == 0) {
+            if (depth == 0) {
+                return pos;
+            }
+            if (pos == end) {
+                error = end;
+                return nullptr;
+            }
+            frame &top = frames[depth - 1];
+            if (*pos == 255) {
+                if (top.map && top.odd) {
+                    error = pos;
+                    return nullptr;
+                }
+                ++pos;
+                pending = top.pending;
+                --depth;
+                continue;
+            }
+            top.odd = !top.odd;
+            pending = 1;
+        }
+        const unsigned char *start = pos;
+        int major, minor;
+        uint64_t value;
+        pos = parse_header(start, end, major, minor, value);
+        if (!pos) {
+            error = header_error(start, end);
+            return nullptr;
+        }
+        --pending;
+        if (nodes) {
+            ++*nodes;
+        }
+        switch (major) {
+        case 2:
+        case 3:
+            if (minor != 31) {
+                if (value > uint64_t(end - pos)) {
+                    error = end;
+                    return nullptr;
+                }
+                if (major == 3 && strict_utf8 && !valid_utf8(pos, value)) {
+                    error = start;
+                    return nullptr;
+                }
+                pos += value;
+                break;
+            }
+            while (pos != end && *pos != 255) {
+                const unsigned char *chunk = pos;
+                int chunk_major, chunk_minor;
+                pos = parse_header(chunk, end, chunk_major, chunk_minor, value);
+                if (!pos) {
+                    error = header_error(chunk, end);
+                    return nullptr;
+                }
+                if (chunk_major != major || chunk_minor == 31) {
+                    error = chunk;
+                    return nullptr;
+                }
+                if (value > uint64_t(end - pos)) {
+                    error = end;
+                    return nullptr;
+                }
+                // Each chunk must be valid UTF-8 on its own
+                if (major == 3 && strict_utf8 && !valid_utf8(pos, value)) {
+                    error = chunk;
+                    return nullptr;
+                }
+                pos += value;
+            }
+            if (pos == end) {
+                error = end;
+                return nullptr;
+            }
+            ++pos;
             break;
-        case TYPE_TAGGED:
-            // fallthrough
-        case TYPE_ARRAY:
-            delete m_array;
-            m_array = nullptr;
+        case 4:
+        case 5:
+            if (minor == 31) {
+                if (depth == max_indefinite_depth) {
+                    error = start;
+                    return nullptr;
+                }
+                frame &top = frames[depth++];
+                top.pending = pending;
+                top.map = major == 5;
+                top.odd = false;
+                pending = 0;
+                break;
+            }
+            // Every item takes at least one byte, so a count larger than
+            // what is left of the input can never be satisfied
+            if (value > uint64_t(end - pos) || (major == 5 && value > uint64_t(end - pos) / 2)) {
+                error = end;
+                return nullptr;
+            }
+            pending += major == 5 ? 2 * value : value;
+            if (pending > uint64_t(end - pos)) {
+                error = end;
+                return nullptr;
+            }
             break;
-        case TYPE_MAP:
-            delete m_map;
-            m_map = nullptr;
+        case 7:
+            // Break outside an indefinite-length item, or a two-byte simple
+            // value that should have been encoded in the initial byte
+            if (minor == 31 || (minor == 24 && value < 32)) {
+                error = start;
+                return nullptr;
+            }
             break;
         default:
-            return;
+            if (minor == 31) {
+                error = start;
+                return nullptr;
+            }
+            if (major == 6) {
+                ++pending;
+            }
+            break;
+        }
+    }
+}
+
+const unsigned char *skip_item(const unsigned char *pos, const unsigned char *end) {
+    const unsigned char *error;
+    return scan_item(pos, end, error, false);
+}
+
+} // namespace
+
+bool cbor::validate(const cbor::binary &in) {
+    return validate(in.data(), in.size());
+}
+
+bool cbor::validate(const unsigned char *data, size_t size) {
+    return validate(data, size, decode_options());
+}
+
+bool cbor::validate(const unsigned char *data, size_t size, const cbor::decode_options &options) {
+    size_t error_offset;
+    return validate(data, size, error_offset, options);
+}
+
+bool cbor::validate(const unsigned char *data, size_t size, size_t &error_offset) {
+    return validate(data, size, error_offset, decode_options());
+}
+
+bool cbor::validate(const unsigned char *data, size_t size, size_t &error_offset, const cbor::decode_options &options) {
+    const unsigned char *error;
+    const unsigned char *end = scan_item(data, data + size, error, options.strict_utf8);
+    if (!end) {
+        error_offset = error - data;
+        return false;
+    }
+    if (end != data + size) {
+        // Anything after the item is an error of its own
+        error_offset = end - data;
+        return false;
+    }
+    return true;
+}
+
+cbor cbor::decode(const cbor::binary &in) {
+    return decode(in.data(), in.size());
+}
+
+cbor cbor::decode(const unsigned char *data, size_t size) {
+    return decode(data, size, decode_options());
+}
+
+cbor cbor::decode(const cbor::binary &in, cbor::arena &arena) {
+    return decode(in.data(), in.size(), arena);
+}
+
+cbor cbor::decode(const unsigned char *data, size_t size, cbor::arena &arena) {
+    decode_options options;
+    options.arena = &arena;
+    return decode(data, size, options);
+}
+
+cbor cbor::decode(const cbor::binary &in, const cbor::decode_options &options) {
+    return decode(in.data(), in.size(), options);
+}
+
+cbor cbor::decode(const unsigned char *data, size_t size, const cbor::decode_options &options) {
+    stats_scope scope(options.stats, options.arena);
+    if (size > options.max_bytes) {
+        return cbor();
+    }
+    memory_source source(data, size);
+    cbor item;
+    uint64_t nodes = 0;
+    if (item.read_item(source, options, nodes, 0) && source.at_end()) {
+        scope.add_bytes(size);
+        return item;
     }
+    return cbor();
+}
+
+cbor cbor::decode_parallel(const unsigned char *data, size_t size, unsigned threads) {
+    return decode_parallel(data, size, decode_options(), threads);
+}
+
+cbor cbor::decode_parallel(const unsigned char *data, size_t size, const cbor::decode_options &options,
+    unsigned threads) {
+    const unsigned char *end = data + size;
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = parse_header(data, end, major, minor, value);
+    if (!pos || major != 4 || size > options.max_bytes) {
+        return decode(data, size, options);
+    }
+    stats_scope scope(options.stats, options.arena);
+    cbor item;
+    item.m_type = cbor::TYPE_ARRAY;
+    item.m_storage = options.arena ? STORAGE_ARENA : STORAGE_HEAP;
+    item.m_borrowing = !options.arena && (options.borrow || options.intern);
+    item.m_array = construct<array>(options.arena);
+    uint64_t nodes = 1;
+    if ((minor != 31 && value > options.max_items)
+        || !read_parallel(pos, end, minor == 31 ? UINT64_MAX : value, minor == 31, *item.m_array, options, nodes,
+            threads, 1)
+        || (minor == 31 && (pos == end || *pos++ != 255)) || pos != end || nodes > options.max_nodes) {
+        return cbor();
+    }
+#if CBOR11_STATS
+    if (cbor::stats *stats = options.stats) {
+        size_t allocations = 0;
+        size_t heap_bytes = 0;
+        item.payload_memory(allocations, heap_bytes);
+        ++stats->nodes[cbor::TYPE_ARRAY];
+        stats->allocations += allocations;
+        stats->allocated_bytes += heap_bytes;
+    }
+#endif
+    scope.add_bytes(size);
+    return item;
+}
+
+bool cbor::decode_sequence(const unsigned char *data, size_t size, cbor::array &out, unsigned threads) {
+    return decode_sequence(data, size, out, decode_options(), threads);
+}
+
+bool cbor::decode_sequence(const unsigned char *data, size_t size, cbor::array &out,
+    const cbor::decode_options &options, unsigned threads) {
+    out.clear();
+    if (size > options.max_bytes) {
+        return false;
+    }
+    stats_scope scope(options.stats, options.arena);
+    const unsigned char *pos = data;
+    uint64_t nodes = 0;
+    if (!read_parallel(pos, data + size, UINT64_MAX, false, out, options, nodes, threads, 0)
+        || nodes > options.max_nodes) {
+        out.clear();
+        return false;
+    }
+    scope.add_bytes(size);
+    return true;
+}
+
+namespace {
+
+#if CBOR11_STATS
+void add_stats(cbor::stats &to, const cbor::stats &from) {
+    for (size_t i = 0; i != sizeof(to.nodes) / sizeof(to.nodes[0]); ++i) {
+        to.nodes[i] += from.nodes[i];
+    }
+    to.allocations += from.allocations;
+    to.allocated_bytes += from.allocated_bytes;
+    to.max_depth = std::max(to.max_depth, from.max_depth);
+    to.indefinite_chunks += from.indefinite_chunks;
+}
+#endif
+
+} // namespace
+
+// Decodes the items from pos into out, count of them, or up to a break or
+// the end when count is UINT64_MAX, and leaves pos past the last one. A
+// serial scan delimits the items, which are then decoded in ranges of
+// about equal size, a few per thread so that uneven items even out.
+// Threads decode into arenas of their own, merged into the caller's once
+// all are done. The items decoded are added to nodes for the caller to
+// check against max_nodes.
+bool cbor::read_parallel(const unsigned char *&pos, const unsigned char *end, uint64_t count, bool until_break,
+    cbor::array &out, const cbor::decode_options &options, uint64_t &nodes, unsigned threads, size_t depth) {
+    struct range {
+        const unsigned char *begin;
+        const unsigned char *end;
+        size_t first;
+        size_t count;
+    };
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads == 1) {
+        // Nothing to split, so the items are decoded as they are found
+        memory_source source(pos, end - pos);
+        if (count != UINT64_MAX) {
+            out.reserve(std::min(count, source.remaining()));
+        }
+        while (out.size() != count && !source.at_end() && !(until_break && source.peek() == 255)) {
+            out.emplace_back();
+            if (out.size() > options.max_items || !out.back().read_item(source, options, nodes, depth)) {
+                return false;
+            }
+        }
+        pos = source.position();
+        return count == UINT64_MAX || out.size() == count;
+    }
+    // The scan counts every node, so max_nodes holds for all the workers
+    // together before any of them allocates
+    size_t target = std::max<size_t>((end - pos) / (size_t(threads) * 4), 1);
+    std::vector<range> ranges;
+    range current = {pos, pos, 0, 0};
+    size_t items = 0;
+    uint64_t scanned = nodes;
+    while (items != count && pos != end && !(until_break && *pos == 255)) {
+        const unsigned char *error;
+        const unsigned char *next = items == options.max_items ? nullptr : scan_item(pos, end, error, false, &scanned);
+        if (!next || scanned > options.max_nodes) {
+            return false;
+        }
+        pos = next;
+        ++items;
+        if (size_t(pos - current.begin) >= target) {
+            current.end = pos;
+            current.count = items - current.first;
+            ranges.push_back(current);
+            current = range {pos, pos, items, 0};
+        }
+    }
+    if (count != UINT64_MAX && items != count) {
+        return false;
+    }
+    if (items != current.first) {
+        current.end = pos;
+        current.count = items - current.first;
+        ranges.push_back(current);
+    }
+    out.resize(items);
+    if (ranges.empty()) {
+        return true;
+    }
+
+    size_t workers = std::min<size_t>(threads, ranges.size());
+    std::vector<std::unique_ptr<cbor::arena>> arenas;
+    for (size_t i = 1; options.arena && i < workers; ++i) {
+        arenas.emplace_back(new cbor::arena);
+    }
+    std::atomic<size_t> next_range(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr exception;
+    std::mutex mutex;
+    auto work = [&](size_t worker) {
+        cbor::decode_options local = options;
+        cbor::stats stats;
+        local.stats = &stats;
+        if (worker) {
+            local.arena = options.arena ? arenas[worker - 1].get() : nullptr;
+            local.intern = nullptr;
+        }
+        uint64_t decoded = 0;
+        try {
+            for (size_t i; !failed && (i = next_range++) < ranges.size(); ) {
+                const range &part = ranges[i];
+                memory_source source(part.begin, part.end - part.begin);
+                for (size_t j = 0; j != part.count; ++j) {
+                    if (!out[part.first + j].read_item(source, local, decoded, depth)) {
+                        failed = true;
+                        break;
+                    }
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!exception) {
+                exception = std::current_exception();
+            }
+            failed = true;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        nodes += decoded;
+#if CBOR11_STATS
+        if (options.stats) {
+            add_stats(*options.stats, stats);
+        }
+#endif
+    };
+    // Whatever leaves this scope, the threads started are joined before the
+    // arenas and the output they write to can go away
+    struct joiner {
+        std::vector<std::thread> threads;
+        std::atomic<bool> &failed;
+
+        ~joiner() {
+            for (std::thread &thread : threads) {
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+        }
+    } pool {std::vector<std::thread>(), failed};
+    try {
+        pool.threads.reserve(workers - 1);
+        for (size_t i = 1; i < workers; ++i) {
+            pool.threads.emplace_back(work, i);
+        }
+    } catch (const std::system_error &) {
+        // The threads already running take over the ranges left
+    } catch (...) {
+        pool.failed = true;
+        throw;
+    }
+    work(0);
+    for (std::thread &thread : pool.threads) {
+        thread.join();
+    }
+    for (std::unique_ptr<cbor::arena> &arena : arenas) {
+        options.arena->merge(*arena);
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+    return !failed;
+}
+
+cbor::binary cbor::encode(const cbor &in) {
+    cbor::binary out;
+    encode_into(in, out);
+    return out;
+}
+
+cbor::binary cbor::encode(const cbor &in, cbor::stats &stats) {
+    cbor::binary out;
+    encode_into(in, out, stats);
+    return out;
+}
+
+void cbor::encode_into(const cbor &in, cbor::binary &out) {
+    size_t offset = out.size();
+    out.resize(offset + encoded_size(in));
+    buffer_sink sink(out.data() + offset);
+    in.write_item(sink);
+}
+
+namespace {
+
+#if CBOR11_STATS
+void count_nodes(const cbor &item, cbor::stats &stats, uint64_t depth) {
+    ++stats.nodes[item.type()];
+    stats.max_depth = std::max(stats.max_depth, depth);
+    switch (item.type()) {
+    case cbor::TYPE_ARRAY:
+        for (const cbor &e : item.as_array()) {
+            count_nodes(e, stats, depth + 1);
+        }
+        break;
+    case cbor::TYPE_MAP:
+        for (auto &&e : item.as_map()) {
+            count_nodes(e.first, stats, depth + 1);
+            count_nodes(e.second, stats, depth + 1);
+        }
+        break;
+    case cbor::TYPE_TAGGED:
+        count_nodes(item.tagged_value(), stats, depth + 1);
+        break;
+    default:
+        break;
+    }
+}
+#endif
+
+} // namespace
+
+void cbor::encode_into(const cbor &in, cbor::binary &out, cbor::stats &stats) {
+#if CBOR11_STATS
+    stats_scope scope(&stats, nullptr);
+    size_t size = out.size();
+    size_t capacity = out.capacity();
+    encode_into(in, out);
+    if (out.capacity() != capacity) {
+        ++stats.allocations;
+        stats.allocated_bytes += out.capacity();
+    }
+    scope.add_bytes(out.size() - size);
+    count_nodes(in, stats, 0);
+#else
+    (void) stats;
+    encode_into(in, out);
+#endif
+}
+
+size_t cbor::encode_into(const cbor &in, unsigned char *out, size_t size) {
+    size_t required = encoded_size(in);
+    if (required > size) {
+        return 0;
+    }
+    buffer_sink sink(out);
+    in.write_item(sink);
+    return required;
+}
+
+cbor::string cbor::debug(const cbor &in) {
+    std::ostringstream out;
+    switch (in.m_type) {
+    case cbor::TYPE_UNSIGNED:
+        out << in.m_unsigned;
+        break;
+    case cbor::TYPE_NEGATIVE:
+        if (1 + in.m_integer == 0) {
+            out << "-18446744073709551616";
+        } else {
+            out << "-" << 1 + in.m_integer;
+        }
+        break;
+    case cbor::TYPE_BINARY:
+        out << "h'";
+        out << std::hex;
+        out.fill('0');
+        for(const unsigned char *it = in.bytes_data(), *end = it + in.bytes_size(); it != end; ++it) {
+            out.width(2);
+            out << int(*it);
+        }
+        out << "'";
+        break;
+    case cbor::TYPE_STRING:
+        out << "\"";
+        out << std::hex;
+        out.fill('0');
+        for(const unsigned char *it = in.bytes_data(), *end = it + in.bytes_size(); it != end; ++it) {
+            char e = *it;
+            switch (e) {
+            case '\n':
+                out << "\\n";
+                break;
+            case '\r':
+                out << "\\r";
+                break;
+            case '\"':
+                out << "\\\"";
+                break;
+            case '\\':
+                out << "\\\\";
+                break;
+            default:
+                if ((unsigned char)e < '\x20') {
+                    out << "\\u";
+                    out.width(4);
+                    out << (int) (unsigned char)e;
+                } else {
+                    out << e;
+                }
+                break;
+            }
+        }
+        out << "\"";
+        break;
+    case cbor::TYPE_ARRAY:
+        out << "[";
+        for (cbor::array::const_iterator it = (*in.m_array).begin(); it != (*in.m_array).end(); ++it) {
+            if (it != in.m_array->begin()) {
+                out << ", ";
+            }
+            out << cbor::debug(*it);
+        }
+        out << "]";
+        break;
+    case cbor::TYPE_MAP:
+        out << "{";
+        for (cbor::map::const_iterator it = (*in.m_map).begin(); it != (*in.m_map).end(); ++it) {
+            if (it != in.m_map->begin()) {
+                out << ", ";
+            }
+            out << cbor::debug(it->first) << ": " << cbor::debug(it->second);
+        }
+        out << "}";
+        break;
+    case cbor::TYPE_TAGGED:
+        out << in.m_unsigned << "(" << cbor::debug(*in.m_child) << ")";
+        break;
+    case cbor::TYPE_SIMPLE:
+        switch (in.m_unsigned) {
+        case cbor::SIMPLE_FALSE:
+            out << "false";
+            break;
+        case cbor::SIMPLE_TRUE:
+            out << "true";
+            break;
+        case cbor::SIMPLE_NULL:
+            out << "null";
+            break;
+        case cbor::SIMPLE_UNDEFINED:
+            out << "undefined";
+            break;
+        default:
+            out << "simple(" << in.m_unsigned << ")";
+            break;
+        }
+        break;
+    case cbor::TYPE_FLOAT:
+        if (std::isinf(in.m_float)) {
+            if (in.m_float < 0) {
+                out << "-";
+            }
+            out << "Infinity";
+        } else if (std::isnan(in.m_float)) {
+            out << "NaN";
+        } else {
+            out << std::showpoint << in.m_float;
+        }
+        break;
+    }
+    return out.str();
+}
+
+namespace {
+
+template <typename Type>
+void release(Type *payload, bool in_arena) {
+    if (in_arena) {
+        payload->~Type();
+        return;
+    }
+    counted<Type> *owner = static_cast<counted<Type> *>(payload);
+    if (owner->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete owner;
+    }
+}
+
+} // namespace
+
+// Gives the node a container or tag payload of its own before it is changed,
+// copying one that other nodes share. The copy shares the children in turn,
+// so only the path to what changes is ever copied.
+void cbor::unshare() {
+    if (m_storage != STORAGE_HEAP) {
+        return;
+    }
+    switch (m_type) {
+    case TYPE_TAGGED:
+        if (shared(m_child)) {
+            cbor *own = new_payload<cbor>(*m_child);
+            release(m_child, false);
+            m_child = own;
+        }
+        break;
+    case TYPE_ARRAY:
+        if (shared(m_array)) {
+            array *own = new_payload<array>(*m_array);
+            release(m_array, false);
+            m_array = own;
+        }
+        break;
+    case TYPE_MAP:
+        if (shared(m_map)) {
+            map *own = new_payload<map>(*m_map);
+            release(m_map, false);
+            m_map = own;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void cbor::destroy()
+{
+    m_borrowing = false;
+    if (m_storage == STORAGE_BORROWED || m_storage == STORAGE_INLINE) {
+        m_storage = STORAGE_HEAP;
+        return;
+    }
+    bool in_arena = m_storage == STORAGE_ARENA;
+    m_storage = STORAGE_HEAP;
+    switch(m_type)
+    {
+        case TYPE_BINARY:
+            release(m_binary, in_arena);
+            m_binary = nullptr;
+            break;
+        case TYPE_STRING:
+            release(m_string, in_arena);
+            m_string = nullptr;
+            break;
+        case TYPE_TAGGED:
+            release(m_child, in_arena);
+            m_child = nullptr;
+            break;
+        case TYPE_ARRAY:
+            release(m_array, in_arena);
+            m_array = nullptr;
+            break;
+        case TYPE_MAP:
+            release(m_map, in_arena);
+            m_map = nullptr;
+            break;
+        default:
+            return;
+    }
+}
+
+// Memory owned by the node beyond the node itself, leaving out what its
+// children own in turn, with the part of it that came from the heap and the
+// number of heap allocations that took.
+size_t cbor::payload_memory(size_t &allocations, size_t &heap_bytes) const {
+    // Container objects live in the arena or on the heap with their node
+    bool heap = m_storage == STORAGE_HEAP;
+    auto add_node = [&](size_t size) {
+        if (heap) {
+            ++allocations;
+            heap_bytes += size;
+        }
+        return size;
+    };
+    size_t own;
+    switch (m_type) {
+    case TYPE_BINARY:
+    case TYPE_STRING:
+        if (m_storage != STORAGE_HEAP) {
+            return m_storage == STORAGE_BORROWED ? bytes_size() : 0;
+        }
+        own = m_type == TYPE_BINARY ? sizeof(counted<binary>) + m_binary->capacity()
+            : sizeof(counted<string>) + m_string->capacity();
+        allocations += 2;
+        heap_bytes += own;
+        return own;
+    case TYPE_ARRAY:
+        own = m_array->capacity() * sizeof(cbor);
+        allocations += m_array->capacity() != 0;
+        heap_bytes += own;
+        return own + add_node(heap ? sizeof(counted<array>) : sizeof(array));
+    case TYPE_MAP:
+        own = m_map->m_items.capacity() * sizeof(map::value_type);
+        allocations += m_map->m_items.capacity() != 0;
+        heap_bytes += own;
+        return own + add_node(heap ? sizeof(counted<map>) : sizeof(map));
+    case TYPE_TAGGED:
+        return add_node(heap ? sizeof(counted<cbor>) : sizeof(cbor));
+    default:
+        return 0;
+    }
+}
+
+size_t cbor::memory_usage() const {
+    size_t allocations = 0;
+    size_t heap_bytes = 0;
+    size_t usage = sizeof(cbor) + payload_memory(allocations, heap_bytes);
+    // Child nodes themselves are part of their parent's payload already
+    switch (m_type) {
+    case TYPE_ARRAY:
+        for (const cbor &e : *m_array) {
+            usage += e.memory_usage() - sizeof(cbor);
+        }
+        break;
+    case TYPE_MAP:
+        for (auto &&e : *m_map) {
+            usage += e.first.memory_usage() + e.second.memory_usage() - 2 * sizeof(cbor);
+        }
+        break;
+    case TYPE_TAGGED:
+        usage += m_child->memory_usage() - sizeof(cbor);
+        break;
+    default:
+        break;
+    }
+    return usage;
+}
+
+unsigned char *cbor::inline_bytes() {
+    static_assert(offsetof(cbor, m_binary) == offsetof(cbor, m_unsigned) + sizeof(uint64_t),
+        "inline strings need the two unions to be adjacent");
+    return reinterpret_cast<unsigned char *>(this) + offsetof(cbor, m_unsigned);
+}
+
+const unsigned char *cbor::inline_bytes() const {
+    return reinterpret_cast<const unsigned char *>(this) + offsetof(cbor, m_unsigned);
+}
+
+// Stores a copy of a byte or text string payload for the current m_type,
+// inline when it fits.
+void cbor::assign_bytes(const unsigned char *data, size_t size) {
+    if (size <= inline_capacity) {
+        m_storage = STORAGE_INLINE;
+        m_inline_size = size;
+        if (size != 0) {
+            std::memcpy(inline_bytes(), data, size);
+        }
+    } else if (m_type == cbor::TYPE_BINARY) {
+        m_storage = STORAGE_HEAP;
+        m_binary = new_payload<binary>(data, data + size);
+    } else {
+        m_storage = STORAGE_HEAP;
+        m_string = new_payload<string>(reinterpret_cast<const char *>(data), size);
+    }
+}
+
+const unsigned char *cbor::bytes_data() const {
+    if (m_storage == STORAGE_INLINE) {
+        return inline_bytes();
+    }
+    if (m_storage == STORAGE_BORROWED) {
+        return m_bytes;
+    }
+    if (m_type == cbor::TYPE_BINARY) {
+        return m_binary->data();
+    }
+    return reinterpret_cast<const unsigned char *>(m_string->data());
+}
+
+size_t cbor::bytes_size() const {
+    if (m_storage == STORAGE_INLINE) {
+        return m_inline_size;
+    }
+    if (m_storage == STORAGE_BORROWED) {
+        return m_unsigned;
+    }
+    if (m_type == cbor::TYPE_BINARY) {
+        return m_binary->size();
+    }
+    return m_string->size();
+}
+
+cbor::arena::arena(size_t block_size) : m_blocks(nullptr), m_pos(nullptr), m_end(nullptr), m_block_size(block_size),
+    m_bytes_allocated(0), m_block_count(0) { }
+
+cbor::arena::~arena() {
+    release();
+}
+
+void *cbor::arena::allocate(size_t size, size_t alignment) {
+    if (m_pos) {
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(m_pos) % alignment) % alignment;
+        if (padding + size <= size_t(m_end - m_pos)) {
+            unsigned char *result = m_pos + padding;
+            m_pos = result + size;
+            m_bytes_allocated += size;
+            return result;
+        }
+    }
+    size_t header = (sizeof(block) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+    size_t payload = std::max(m_block_size, size + alignment);
+    block *fresh = static_cast<block *>(::operator new(header + payload));
+    fresh->next = m_blocks;
+    fresh->size = header + payload;
+    m_blocks = fresh;
+    ++m_block_count;
+    unsigned char *begin = reinterpret_cast<unsigned char *>(fresh) + header;
+    unsigned char *result = begin + (alignment - reinterpret_cast<uintptr_t>(begin) % alignment) % alignment;
+    m_bytes_allocated += size;
+    // Oversized requests get a block of their own so whatever is left of the
+    // current block stays available to the allocations that follow
+    if (payload == m_block_size || m_pos == nullptr) {
+        m_pos = result + size;
+        m_end = begin + payload;
+    }
+    return result;
+}
+
+void cbor::arena::release() {
+    while (m_blocks) {
+        block *next = m_blocks->next;
+        ::operator delete(m_blocks);
+        m_blocks = next;
+    }
+    m_pos = nullptr;
+    m_end = nullptr;
+    m_bytes_allocated = 0;
+    m_block_count = 0;
+}
+
+void cbor::arena::merge(arena &other) {
+    if (!other.m_blocks) {
+        return;
+    }
+    // Blocks are only ever freed all together, so other's go in front
+    // while allocation carries on from the current block
+    block *last = other.m_blocks;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = m_blocks;
+    m_blocks = other.m_blocks;
+    m_bytes_allocated += other.m_bytes_allocated;
+    m_block_count += other.m_block_count;
+    other.m_blocks = nullptr;
+    other.m_pos = nullptr;
+    other.m_end = nullptr;
+    other.m_bytes_allocated = 0;
+    other.m_block_count = 0;
+}
+
+size_t cbor::arena::bytes_allocated() const {
+    return m_bytes_allocated;
+}
+
+size_t cbor::arena::block_count() const {
+    return m_block_count;
+}
+
+const size_t cbor::intern_table::max_length;
+
+cbor::intern_table::intern_table(size_t max_keys, size_t max_bytes) : m_storage(4096), m_max_keys(max_keys),
+    m_max_bytes(max_bytes), m_size(0), m_lookups(0), m_hits(0) { }
+
+size_t cbor::intern_table::size() const {
+    return m_size;
+}
+
+size_t cbor::intern_table::bytes() const {
+    return m_storage.bytes_allocated();
+}
+
+uint64_t cbor::intern_table::lookups() const {
+    return m_lookups;
+}
+
+uint64_t cbor::intern_table::hits() const {
+    return m_hits;
+}
+
+double cbor::intern_table::hit_rate() const {
+    return m_lookups ? double(m_hits) / m_lookups : 0;
+}
+
+void cbor::intern_table::clear() {
+    m_slots.clear();
+    m_storage.release();
+    m_size = 0;
+    m_lookups = 0;
+    m_hits = 0;
+}
+
+const unsigned char *cbor::intern_table::intern(const unsigned char *data, size_t size) {
+    ++m_lookups;
+    if (m_slots.empty()) {
+        m_slots.assign(16, slot {nullptr, 0, 0});
+    }
+    uint64_t hash = hash_bytes(0, data, size);
+    size_t mask = m_slots.size() - 1;
+    size_t i = hash & mask;
+    for (; m_slots[i].data; i = (i + 1) & mask) {
+        const slot &entry = m_slots[i];
+        if (entry.hash == hash && entry.size == size && std::memcmp(entry.data, data, size) == 0) {
+            ++m_hits;
+            return entry.data;
+        }
+    }
+    if (m_size == m_max_keys || size > m_max_bytes - std::min(m_max_bytes, bytes())) {
+        return nullptr;
+    }
+    unsigned char *copy = static_cast<unsigned char *>(m_storage.allocate(size, 1));
+    std::memcpy(copy, data, size);
+    m_slots[i] = slot {copy, size, hash};
+    ++m_size;
+    // Kept at most half full, so probing always ends at an empty slot. The
+    // table grows with the keys it holds rather than with max_keys, so it
+    // never outgrows memory the keys did not.
+    if (m_size > m_slots.size() / 2) {
+        std::vector<slot> slots(m_slots.size() * 2, slot {nullptr, 0, 0});
+        mask = slots.size() - 1;
+        for (const slot &entry : m_slots) {
+            if (entry.data) {
+                size_t j = entry.hash & mask;
+                while (slots[j].data) {
+                    j = (j + 1) & mask;
+                }
+                slots[j] = entry;
+            }
+        }
+        m_slots.swap(slots);
+    }
+    return copy;
+}
+
+// The bytes of an open file and the tree decoded from them. The tree goes
+// before the bytes it borrows from.
+struct cbor::file::mapping {
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    cbor::binary contents;
+    cbor root;
+    bool valid = false;
+
+    bool open(const std::string &path);
+    ~mapping();
+};
+
+bool cbor::file::mapping::open(const std::string &path) {
+#if CBOR11_MMAP
+    int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+        ::close(descriptor);
+        return false;
+    }
+    size = size_t(status.st_size);
+    if (size != 0) {
+        void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address == MAP_FAILED) {
+            ::close(descriptor);
+            return false;
+        }
+#ifdef MADV_SEQUENTIAL
+        // Decoding reads the file once, front to back
+        madvise(address, size, MADV_SEQUENTIAL);
+#endif
+        data = static_cast<const unsigned char *>(address);
+        mapped = true;
+    }
+    ::close(descriptor);
+    return true;
+#else
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    data = contents.data();
+    size = contents.size();
+    return !in.bad();
+#endif
+}
+
+cbor::file::mapping::~mapping() {
+    root = cbor();
+#if CBOR11_MMAP
+    if (mapped) {
+        munmap(const_cast<unsigned char *>(data), size);
+    }
+#endif
+}
+
+cbor::file::file() { }
+
+cbor::file::file(const std::string &path) : file(path, decode_options()) { }
+
+cbor::file::file(const std::string &path, const cbor::decode_options &options) {
+    std::shared_ptr<mapping> opened = std::make_shared<mapping>();
+    if (!opened->open(path)) {
+        return;
+    }
+    if (opened->size <= options.max_bytes) {
+        stats_scope scope(options.stats, options.arena);
+        cbor::decode_options borrowing = options;
+        borrowing.borrow = true;
+        memory_source source(opened->data, opened->size);
+        uint64_t nodes = 0;
+        opened->valid = opened->root.read_item(source, borrowing, nodes, 0) && source.at_end();
+        if (opened->valid) {
+            scope.add_bytes(opened->size);
+        } else {
+            // Malformed, truncated or over a limit, or followed by trailing
+            // bytes, so whatever was decoded is dropped
+            opened->root = cbor();
+        }
+    }
+    m_mapping = opened;
+}
+
+bool cbor::file::valid() const {
+    return m_mapping && m_mapping->valid;
+}
+
+const cbor &cbor::file::root() const {
+    static const cbor undefined;
+    return m_mapping ? m_mapping->root : undefined;
+}
+
+const unsigned char *cbor::file::data() const {
+    return m_mapping ? m_mapping->data : nullptr;
+}
+
+size_t cbor::file::size() const {
+    return m_mapping ? m_mapping->size : 0;
+}
+
+cbor_view cbor::file::view() const {
+    return cbor_view(data(), size());
+}
+
+cbor_view::cbor_view() : m_data(nullptr), m_end(nullptr) { }
+
+cbor_view::cbor_view(const unsigned char *data, size_t size) : m_data(size ? data : nullptr), m_end(data + size) { }
+
+cbor_view::cbor_view(const cbor::binary &data) : cbor_view(data.data(), data.size()) { }
+
+const unsigned char *cbor_view::header(int &major, int &minor, uint64_t &value) const {
+    if (!m_data) {
+        return nullptr;
+    }
+    const unsigned char *pos = parse_header(m_data, m_end, major, minor, value);
+    if (!pos || (minor == 31 && (major < 2 || major > 5))) {
+        return nullptr;
+    }
+    return pos;
+}
+
+bool cbor_view::valid() const {
+    return m_data != nullptr;
+}
+
+cbor::type_t cbor_view::type() const {
+    int major, minor;
+    uint64_t value;
+    if (!header(major, minor, value)) {
+        return cbor::TYPE_SIMPLE;
+    }
+    switch (major) {
+    case 0:
+        return cbor::TYPE_UNSIGNED;
+    case 1:
+        return cbor::TYPE_NEGATIVE;
+    case 2:
+        return cbor::TYPE_BINARY;
+    case 3:
+        return cbor::TYPE_STRING;
+    case 4:
+        return cbor::TYPE_ARRAY;
+    case 5:
+        return cbor::TYPE_MAP;
+    case 6:
+        return cbor::TYPE_TAGGED;
+    default:
+        return minor >= 25 ? cbor::TYPE_FLOAT : cbor::TYPE_SIMPLE;
+    }
+}
+
+bool cbor_view::is_unsigned() const {
+    return type() == cbor::TYPE_UNSIGNED;
+}
+
+bool cbor_view::is_signed() const {
+    int major, minor;
+    uint64_t value;
+    return header(major, minor, value) && major < 2 && (value >> 63) == 0;
+}
+
+bool cbor_view::is_int() const {
+    return type() == cbor::TYPE_UNSIGNED || type() == cbor::TYPE_NEGATIVE;
+}
+
+bool cbor_view::is_binary() const {
+    return type() == cbor::TYPE_BINARY;
+}
+
+bool cbor_view::is_string() const {
+    return type() == cbor::TYPE_STRING;
+}
+
+bool cbor_view::is_array() const {
+    return type() == cbor::TYPE_ARRAY;
+}
+
+bool cbor_view::is_map() const {
+    return type() == cbor::TYPE_MAP;
+}
+
+bool cbor_view::is_tagged() const {
+    return type() == cbor::TYPE_TAGGED;
+}
+
+bool cbor_view::is_simple() const {
+    return type() == cbor::TYPE_SIMPLE;
+}
+
+bool cbor_view::is_bool() const {
+    return is_simple() && (to_simple() == cbor::SIMPLE_FALSE || to_simple() == cbor::SIMPLE_TRUE);
+}
+
+bool cbor_view::is_null() const {
+    return is_simple() && to_simple() == cbor::SIMPLE_NULL;
+}
+
+bool cbor_view::is_undefined() const {
+    return is_simple() && to_simple() == cbor::SIMPLE_UNDEFINED;
+}
+
+bool cbor_view::is_float() const {
+    return type() == cbor::TYPE_FLOAT;
+}
+
+bool cbor_view::is_number() const {
+    cbor::type_t t = type();
+    return t == cbor::TYPE_UNSIGNED || t == cbor::TYPE_NEGATIVE || t == cbor::TYPE_FLOAT;
+}
+
+uint64_t cbor_view::to_unsigned() const {
+    int major, minor;
+    uint64_t value;
+    if (!header(major, minor, value)) {
+        return 0;
+    }
+    switch (major) {
+    case 0:
+    case 1:
+        return value;
+    case 6:
+        return child().to_unsigned();
+    case 7:
+        return minor >= 25 ? uint64_t(decode_float(minor, value)) : 0;
+    default:
+        return 0;
+    }
+}
+
+int64_t cbor_view::to_signed() const {
+    int major, minor;
+    uint64_t value;
+    if (!header(major, minor, value)) {
+        return 0;
+    }
+    switch (major) {
+    case 0:
+        return value;
+    case 1:
+        return -1 - int64_t(value);
+    case 6:
+        return child().to_signed();
+    case 7:
+        return minor >= 25 ? int64_t(decode_float(minor, value)) : 0;
+    default:
+        return 0;
+    }
+}
+
+cbor::binary cbor_view::to_binary() const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (pos && major == 2 && minor != 31 && value <= uint64_t(m_end - pos)) {
+        return cbor::binary(pos, pos + value);
+    }
+    if (pos && major == 6) {
+        return child().to_binary();
+    }
+    return to_cbor().to_binary();
+}
+
+cbor::string cbor_view::to_string() const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (pos && major == 3 && minor != 31 && value <= uint64_t(m_end - pos)) {
+        return cbor::string(reinterpret_cast<const char *>(pos), value);
+    }
+    if (pos && major == 6) {
+        return child().to_string();
+    }
+    return to_cbor().to_string();
+}
+
+cbor::array cbor_view::to_array() const {
+    if (is_tagged()) {
+        return child().to_array();
+    }
+    return is_array() ? to_cbor().to_array() : cbor::array();
+}
+
+cbor::map cbor_view::to_map() const {
+    if (is_tagged()) {
+        return child().to_map();
+    }
+    return is_map() ? to_cbor().to_map() : cbor::map();
+}
+
+cbor::simple cbor_view::to_simple() const {
+    int major, minor;
+    uint64_t value;
+    if (!header(major, minor, value)) {
+        return cbor::SIMPLE_UNDEFINED;
+    }
+    if (major == 6) {
+        return child().to_simple();
+    }
+    if (major == 7 && minor < 25) {
+        return cbor::simple(value);
+    }
+    return cbor::SIMPLE_UNDEFINED;
+}
+
+bool cbor_view::to_bool() const {
+    return to_simple() == cbor::SIMPLE_TRUE;
+}
+
+double cbor_view::to_float() const {
+    int major, minor;
+    uint64_t value;
+    if (!header(major, minor, value)) {
+        return 0.0;
+    }
+    switch (major) {
+    case 0:
+        return double(value);
+    case 1:
+        return -1.0 - double(value);
+    case 6:
+        return child().to_float();
+    case 7:
+        return minor >= 25 ? decode_float(minor, value) : 0.0;
+    default:
+        return 0.0;
+    }
+}
+
+uint64_t cbor_view::tag() const {
+    int major, minor;
+    uint64_t value;
+    if (header(major, minor, value) && major == 6) {
+        return value;
+    }
+    return 0;
+}
+
+cbor_view cbor_view::child() const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (pos && major == 6) {
+        return cbor_view(pos, m_end - pos);
+    }
+    return cbor_view();
+}
+
+size_t cbor_view::size() const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (!pos || major < 2 || major > 5) {
+        return 0;
+    }
+    if (minor != 31) {
+        return value;
+    }
+    if (major < 4) {
+        // Add up the chunks of an indefinite-length string
+        size_t size = 0;
+        int chunk_major, chunk_minor;
+        uint64_t chunk_size;
+        while (pos && pos != m_end && *pos != 255) {
+            if (!parse_header(pos, m_end, chunk_major, chunk_minor, chunk_size)) {
+                break;
+            }
+            size += chunk_size;
+            pos = skip_item(pos, m_end);
+        }
+        return size;
+    }
+    size_t count = 0;
+    while (pos && pos != m_end && *pos != 255) {
+        pos = skip_item(pos, m_end);
+        ++count;
+    }
+    return major == 5 ? count / 2 : count;
+}
+
+cbor_view cbor_view::operator [] (size_t index) const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (!pos || major != 4 || (minor != 31 && index >= value)) {
+        return cbor_view();
+    }
+    for (size_t i = 0; pos && i != index; ++i) {
+        if (minor == 31 && (pos == m_end || *pos == 255)) {
+            return cbor_view();
+        }
+        pos = skip_item(pos, m_end);
+    }
+    if (!pos || pos == m_end || (minor == 31 && *pos == 255)) {
+        return cbor_view();
+    }
+    return cbor_view(pos, m_end - pos);
+}
+
+cbor_view cbor_view::operator [] (const cbor &key) const {
+    return find(key);
+}
+
+cbor_view cbor_view::find(const char *key) const {
+    return find(key, std::strlen(key));
+}
+
+cbor_view cbor_view::find(const char *key, size_t size) const {
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (!pos || major != 5) {
+        return cbor_view();
+    }
+    for (uint64_t i = 0; pos && pos != m_end && (minor == 31 ? *pos != 255 : i != value); ++i) {
+        int key_major, key_minor;
+        uint64_t key_size;
+        const unsigned char *text = parse_header(pos, m_end, key_major, key_minor, key_size);
+        const unsigned char *next = skip_item(pos, m_end);
+        if (!text || !next) {
+            return cbor_view();
+        }
+        if (key_major == 3) {
+            bool match;
+            if (key_minor == 31) {
+                match = cbor_view(pos, next - pos).to_string() == cbor::string(key, size);
+            } else {
+                match = key_size == size && std::memcmp(text, key, size) == 0;
+            }
+            if (match) {
+                return cbor_view(next, m_end - next);
+            }
+        }
+        pos = skip_item(next, m_end);
+    }
+    return cbor_view();
+}
+
+cbor_view cbor_view::find(const cbor &key) const {
+    if (key.is_string()) {
+        cbor::string text = key.to_string();
+        return find(text.data(), text.size());
+    }
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (!pos || major != 5) {
+        return cbor_view();
+    }
+    // Other keys are matched on their shortest-form encoding
+    const cbor::binary encoded = cbor::encode(key);
+    for (uint64_t i = 0; pos && pos != m_end && (minor == 31 ? *pos != 255 : i != value); ++i) {
+        const unsigned char *next = skip_item(pos, m_end);
+        if (!next) {
+            return cbor_view();
+        }
+        if (size_t(next - pos) == encoded.size() && std::memcmp(pos, encoded.data(), encoded.size()) == 0) {
+            return cbor_view(next, m_end - next);
+        }
+        pos = skip_item(next, m_end);
+    }
+    return cbor_view();
+}
+
+namespace {
+
+// One step of a path: a text map key, or an array index where key is null.
+struct path_step {
+    const char *key;
+    size_t size;
+    size_t index;
+};
+
+// Reads the step of a path that starts at pos and moves past it: a key after
+// a '.', or at the start of the path, up to the next '.' or '[', or an index
+// in brackets.
+bool parse_step(const char *&pos, bool first, path_step &step) {
+    if (*pos == '[') {
+        ++pos;
+        if (*pos < '0' || *pos > '9') {
+            return false;
+        }
+        size_t index = 0;
+        for (; *pos >= '0' && *pos <= '9'; ++pos) {
+            if (index > (SIZE_MAX - 9) / 10) {
+                return false;
+            }
+            index = index * 10 + (*pos - '0');
+        }
+        if (*pos != ']') {
+            return false;
+        }
+        ++pos;
+        step = path_step {nullptr, 0, index};
+        return true;
+    }
+    if (!first) {
+        if (*pos != '.') {
+            return false;
+        }
+        ++pos;
+    }
+    const char *key = pos;
+    while (*pos && *pos != '.' && *pos != '[') {
+        ++pos;
+    }
+    step = path_step {key, size_t(pos - key), 0};
+    return pos != key;
+}
+
+bool same_step(const path_step &left, const path_step &right) {
+    if (!left.key || !right.key) {
+        return !left.key && !right.key && left.index == right.index;
+    }
+    return left.size == right.size && std::memcmp(left.key, right.key, left.size) == 0;
+}
+
+} // namespace
+
+// The paths given to project merged into a tree of steps, whose first node
+// stands for the item itself. A node that ends a path takes in the whole
+// subtree below it.
+struct cbor_view::projection {
+    struct node {
+        path_step step;
+        bool whole;
+        std::vector<size_t> children;
+    };
+
+    std::vector<node> nodes;
+};
+
+cbor_view cbor_view::path(const char *query) const {
+    cbor_view item = *this;
+    path_step step;
+    for (const char *pos = query; *pos && item.valid(); ) {
+        if (!parse_step(pos, pos == query, step)) {
+            return cbor_view();
+        }
+        item = step.key ? item.find(step.key, step.size) : item[step.index];
+    }
+    return item;
+}
+
+cbor_view cbor_view::path(const cbor::string &query) const {
+    return path(query.c_str());
+}
+
+cbor cbor_view::project(const std::vector<cbor::string> &paths) const {
+    projection tree;
+    tree.nodes.push_back(projection::node {path_step {nullptr, 0, 0}, false, std::vector<size_t>()});
+    for (const cbor::string &query : paths) {
+        size_t at = 0;
+        path_step step;
+        for (const char *pos = query.c_str(); *pos; ) {
+            if (!parse_step(pos, pos == query.c_str(), step)) {
+                return cbor();
+            }
+            if (tree.nodes[at].whole) {
+                // Already taken in by a shorter path
+                continue;
+            }
+            size_t next = 0;
+            for (size_t child : tree.nodes[at].children) {
+                if (same_step(tree.nodes[child].step, step)) {
+                    next = child;
+                    break;
+                }
+            }
+            if (!next) {
+                next = tree.nodes.size();
+                tree.nodes.push_back(projection::node {step, false, std::vector<size_t>()});
+                tree.nodes[at].children.push_back(next);
+            }
+            at = next;
+        }
+        tree.nodes[at].whole = true;
+    }
+    cbor out;
+    return project(tree, 0, out) ? out : cbor();
+}
+
+// Decodes into out what lies on the paths below the given node of the tree,
+// returning false if nothing does.
+bool cbor_view::project(const projection &paths, size_t node, cbor &out) const {
+    const projection::node &at = paths.nodes[node];
+    if (at.whole) {
+        size_t size = encoded_size();
+        if (!size) {
+            return false;
+        }
+        // Decoding gives undefined on failure, which is only encoded as 0xf7
+        out = cbor::decode(m_data, size);
+        return !out.is_undefined() || (size == 1 && *m_data == 0xf7);
+    }
+    int major, minor;
+    uint64_t value;
+    const unsigned char *pos = header(major, minor, value);
+    if (!pos || (major != 4 && major != 5)) {
+        return false;
+    }
+    if (major == 5) {
+        cbor::map found;
+        for (uint64_t i = 0; pos && pos != m_end && (minor == 31 ? *pos != 255 : i != value); ++i) {
+            int key_major, key_minor;
+            uint64_t key_size;
+            const unsigned char *text = parse_header(pos, m_end, key_major, key_minor, key_size);
+            const unsigned char *next = skip_item(pos, m_end);
+            if (!text || !next) {
+                return false;
+            }
+            if (key_major == 3) {
+                // Only a key written in chunks needs putting together
+                cbor::string joined;
+                if (key_minor == 31) {
+                    joined = cbor_view(pos, next - pos).to_string();
+                    text = reinterpret_cast<const unsigned char *>(joined.data());
+                    key_size = joined.size();
+                }
+                for (size_t child : at.children) {
+                    const path_step &step = paths.nodes[child].step;
+                    cbor item;
+                    if (step.key && step.size == key_size && std::memcmp(step.key, text, key_size) == 0
+                        && cbor_view(next, m_end - next).project(paths, child, item)) {
+                        found.emplace(cbor::string(step.key, step.size), std::move(item));
+                        break;
+                    }
+                }
+            }
+            pos = skip_item(next, m_end);
+        }
+        if (found.empty()) {
+            return false;
+        }
+        out = std::move(found);
+        return true;
+    }
+    size_t last = 0;
+    bool indexed = false;
+    for (size_t child : at.children) {
+        if (!paths.nodes[child].step.key) {
+            last = std::max(last, paths.nodes[child].step.index);
+            indexed = true;
+        }
+    }
+    cbor::array found;
+    for (size_t i = 0; indexed && pos && pos != m_end && (minor == 31 ? *pos != 255 : i != value) && i <= last; ++i) {
+        for (size_t child : at.children) {
+            const path_step &step = paths.nodes[child].step;
+            cbor item;
+            if (!step.key && step.index == i && cbor_view(pos, m_end - pos).project(paths, child, item)) {
+                found.resize(i + 1);
+                found[i] = std::move(item);
+                break;
+            }
+        }
+        pos = skip_item(pos, m_end);
+    }
+    if (found.empty()) {
+        return false;
+    }
+    out = std::move(found);
+    return true;
+}
+
+const unsigned char *cbor_view::data() const {
+    return m_data;
+}
+
+size_t cbor_view::encoded_size() const {
+    const unsigned char *end = m_data ? skip_item(m_data, m_end) : nullptr;
+    return end ? end - m_data : 0;
+}
+
+cbor cbor_view::to_cbor() const {
+    size_t size = encoded_size();
+    return size ? cbor::decode(m_data, size) : cbor();
+}
+
+cbor_handler::~cbor_handler() { }
+
+void cbor_handler::begin_array(uint64_t, bool) { }
+
+void cbor_handler::end_array() { }
+
+void cbor_handler::begin_map(uint64_t, bool) { }
+
+void cbor_handler::end_map() { }
+
+void cbor_handler::map_key() { }
+
+void cbor_handler::unsigned_integer(uint64_t) { }
+
+void cbor_handler::negative_integer(uint64_t) { }
+
+void cbor_handler::begin_binary(uint64_t, bool) { }
+
+void cbor_handler::binary_chunk(const unsigned char *, size_t) { }
+
+void cbor_handler::end_binary() { }
+
+void cbor_handler::begin_string(uint64_t, bool) { }
+
+void cbor_handler::string_chunk(const char *, size_t) { }
+
+void cbor_handler::end_string() { }
+
+void cbor_handler::tag(uint64_t) { }
+
+void cbor_handler::simple(unsigned) { }
+
+void cbor_handler::floating(double) { }
+
+cbor_parser::cbor_parser(cbor_handler &handler) : m_handler(handler) {
+    reset();
+}
+
+void cbor_parser::reset() {
+    m_stack.clear();
+    m_header_size = 0;
+    m_header_needed = 1;
+    m_payload = 0;
+    m_chunked = false;
+    m_payload_major = 0;
+    m_position = 0;
+    m_done = false;
+    m_failed = false;
+}
+
+size_t cbor_parser::feed(const unsigned char *data, size_t size) {
+    const unsigned char *pos = data;
+    const unsigned char *end = data + size;
+    while (pos != end && !m_done && !m_failed) {
+        if (m_payload) {
+            size_t chunk = std::min<uint64_t>(m_payload, end - pos);
+            m_position += chunk;
+            payload(pos, chunk);
+            pos += chunk;
+            continue;
+        }
+        m_header[m_header_size++] = *pos++;
+        ++m_position;
+        if (m_header_size == 1) {
+            int minor = m_header[0] & 31;
+            if (minor > 27 && minor < 31) {
+                --m_position;
+                m_failed = true;
+                break;
+            }
+            m_header_needed = minor >= 24 && minor <= 27 ? 1 + (size_t(1) << (minor - 24)) : 1;
+        }
+        if (m_header_size == m_header_needed) {
+            header();
+        }
+    }
+    return pos - data;
+}
+
+uint64_t cbor_parser::wanted() const {
+    if (m_done || m_failed) {
+        return 0;
+    }
+    if (m_payload) {
+        return m_payload;
+    }
+    return m_header_needed - m_header_size;
+}
+
+bool cbor_parser::done() const {
+    return m_done;
+}
+
+bool cbor_parser::failed() const {
+    return m_failed;
+}
+
+uint64_t cbor_parser::position() const {
+    return m_position;
+}
+
+uint64_t cbor_parser::chunk_remaining() const {
+    return m_payload;
+}
+
+void cbor_parser::payload(const unsigned char *data, size_t size) {
+    m_payload -= size;
+    if (m_payload_major == 2) {
+        m_handler.binary_chunk(data, size);
+    } else {
+        m_handler.string_chunk(reinterpret_cast<const char *>(data), size);
+    }
+    if (m_payload == 0 && !m_chunked) {
+        if (m_payload_major == 2) {
+            m_handler.end_binary();
+        } else {
+            m_handler.end_string();
+        }
+        end_item();
+    }
+}
+
+void cbor_parser::header() {
+    int major = m_header[0] >> 5;
+    int minor = m_header[0] & 31;
+    uint64_t value = minor < 24 ? minor : 0;
+    for (size_t i = 1; i != m_header_size; ++i) {
+        value = value << 8 | m_header[i];
+    }
+    size_t header_size = m_header_size;
+    m_header_size = 0;
+    m_header_needed = 1;
+
+    frame *top = m_stack.empty() ? nullptr : &m_stack.back();
+    if (top && (top->type == FRAME_BINARY || top->type == FRAME_STRING)) {
+        // An indefinite-length string holds definite chunks of its own type up to a break
+        if (m_header[0] == 255) {
+            frame_t type = top->type;
+            m_stack.pop_back();
+            if (type == FRAME_BINARY) {
+                m_handler.end_binary();
+            } else {
+                m_handler.end_string();
+            }
+            end_item();
+        } else if (major != (top->type == FRAME_BINARY ? 2 : 3) || minor == 31) {
+            m_position -= header_size;
+            m_failed = true;
+        } else {
+            m_payload = value;
+            m_chunked = true;
+            m_payload_major = major;
+        }
+        return;
+    }
+    if (m_header[0] == 255) {
+        if (!top || !top->indefinite || (top->type == FRAME_MAP && top->items % 2)) {
+            m_position -= header_size;
+            m_failed = true;
+            return;
+        }
+        frame_t type = top->type;
+        m_stack.pop_back();
+        if (type == FRAME_ARRAY) {
+            m_handler.end_array();
+        } else {
+            m_handler.end_map();
+        }
+        end_item();
+        return;
+    }
+    if ((minor == 31 && (major < 2 || major == 6)) || (major == 5 && minor != 31 && value > UINT64_MAX / 2)
+        || (major == 7 && minor == 24 && value < 32)) {
+        m_position -= header_size;
+        m_failed = true;
+        return;
+    }
+    begin_item();
+    switch (major) {
+    case 0:
+        m_handler.unsigned_integer(value);
+        end_item();
+        break;
+    case 1:
+        m_handler.negative_integer(value);
+        end_item();
+        break;
+    case 2:
+    case 3: {
+        bool indefinite = minor == 31;
+        if (major == 2) {
+            m_handler.begin_binary(value, indefinite);
+        } else {
+            m_handler.begin_string(value, indefinite);
+        }
+        if (indefinite) {
+            frame chunks = { major == 2 ? FRAME_BINARY : FRAME_STRING, true, 0 };
+            m_stack.push_back(chunks);
+        } else if (value) {
+            m_payload = value;
+            m_chunked = false;
+            m_payload_major = major;
+        } else {
+            if (major == 2) {
+                m_handler.end_binary();
+            } else {
+                m_handler.end_string();
+            }
+            end_item();
+        }
+        break;
+    }
+    case 4:
+    case 5: {
+        bool indefinite = minor == 31;
+        if (major == 4) {
+            m_handler.begin_array(value, indefinite);
+        } else {
+            m_handler.begin_map(value, indefinite);
+        }
+        if (indefinite || value) {
+            frame container = { major == 4 ? FRAME_ARRAY : FRAME_MAP, indefinite, major == 5 ? 2 * value : value };
+            m_stack.push_back(container);
+        } else {
+            if (major == 4) {
+                m_handler.end_array();
+            } else {
+                m_handler.end_map();
+            }
+            end_item();
+        }
+        break;
+    }
+    case 6: {
+        m_handler.tag(value);
+        frame tagged = { FRAME_TAGGED, false, 1 };
+        m_stack.push_back(tagged);
+        break;
+    }
+    default:
+        if (minor >= 25) {
+            m_handler.floating(decode_float(minor, value));
+        } else {
+            m_handler.simple(value);
+        }
+        end_item();
+        break;
+    }
+}
+
+void cbor_parser::begin_item() {
+    // Map entries alternate between keys and values in both counting directions
+    if (!m_stack.empty() && m_stack.back().type == FRAME_MAP && m_stack.back().items % 2 == 0) {
+        m_handler.map_key();
+    }
+}
+
+void cbor_parser::end_item() {
+    while (!m_stack.empty()) {
+        frame &top = m_stack.back();
+        if (top.indefinite) {
+            ++top.items;
+            return;
+        }
+        if (--top.items) {
+            return;
+        }
+        frame_t type = top.type;
+        m_stack.pop_back();
+        if (type == FRAME_ARRAY) {
+            m_handler.end_array();
+        } else if (type == FRAME_MAP) {
+            m_handler.end_map();
+        }
+    }
+    m_done = true;
+}
+
+bool cbor_parser::parse(const unsigned char *data, size_t size, cbor_handler &handler) {
+    cbor_parser parser(handler);
+    size_t used = parser.feed(data, size);
+    return parser.done() && used == size;
+}
+
+bool cbor_parser::parse(std::istream &in, cbor_handler &handler) {
+    cbor_parser parser(handler);
+    unsigned char buffer[4096];
+    while (!parser.done()) {
+        size_t size = std::min<uint64_t>(parser.wanted(), sizeof(buffer));
+        if (!in.read(reinterpret_cast<char *>(buffer), size)) {
+            return false;
+        }
+        parser.feed(buffer, size);
+        if (parser.failed()) {
+            in.setstate(std::ios_base::failbit);
+            return false;
+        }
+    }
+    return true;
+}
+
+cbor_writer::cbor_writer(cbor::binary &out) : m_buffer(&out), m_stream(nullptr) { }
+
+cbor_writer::cbor_writer(std::ostream &out) : m_buffer(nullptr), m_stream(&out) { }
+
+void cbor_writer::header(int major, uint64_t value) {
+    if (m_buffer) {
+        vector_sink sink(*m_buffer);
+        write_uint(sink, major, value);
+    } else {
+        stream_sink sink(*m_stream);
+        write_uint(sink, major, value);
+    }
+}
+
+void cbor_writer::raw(const void *data, size_t size) {
+    if (m_buffer) {
+        vector_sink(*m_buffer).write(data, size);
+    } else {
+        m_stream->write(static_cast<const char *>(data), size);
+    }
+}
+
+void cbor_writer::begin_item() {
+    assert(m_open.empty() || m_open.back().indefinite || m_open.back().items > 0);
+}
+
+void cbor_writer::end_item() {
+    while (!m_open.empty()) {
+        frame &top = m_open.back();
+        if (top.indefinite) {
+            ++top.items;
+            return;
+        }
+        if (--top.items) {
+            return;
+        }
+        m_open.pop_back();
+    }
+}
+
+void cbor_writer::begin_array(uint64_t size) {
+    begin_item();
+    header(4, size);
+    if (size) {
+        frame array = { size, false, false };
+        m_open.push_back(array);
+    } else {
+        end_item();
+    }
+}
+
+void cbor_writer::begin_array() {
+    begin_item();
+    unsigned char initial = 4 << 5 | 31;
+    raw(&initial, 1);
+    frame array = { 0, true, false };
+    m_open.push_back(array);
+}
+
+void cbor_writer::begin_map(uint64_t size) {
+    begin_item();
+    header(5, size);
+    if (size) {
+        frame map = { 2 * size, false, true };
+        m_open.push_back(map);
+    } else {
+        end_item();
+    }
+}
+
+void cbor_writer::begin_map() {
+    begin_item();
+    unsigned char initial = 5 << 5 | 31;
+    raw(&initial, 1);
+    frame map = { 0, true, true };
+    m_open.push_back(map);
+}
+
+void cbor_writer::end() {
+    assert(!m_open.empty() && m_open.back().indefinite);
+    assert(!m_open.back().map || m_open.back().items % 2 == 0);
+    unsigned char stop = 255;
+    raw(&stop, 1);
+    m_open.pop_back();
+    end_item();
+}
+
+void cbor_writer::tag(uint64_t value) {
+    begin_item();
+    header(6, value);
+    frame tagged = { 1, false, false };
+    m_open.push_back(tagged);
+}
+
+void cbor_writer::put(unsigned value) {
+    put(uint64_t(value));
+}
+
+void cbor_writer::put(uint64_t value) {
+    begin_item();
+    header(0, value);
+    end_item();
+}
+
+void cbor_writer::put(int value) {
+    put(int64_t(value));
+}
+
+void cbor_writer::put(int64_t value) {
+    begin_item();
+    if (value < 0) {
+        header(1, -1 - value);
+    } else {
+        header(0, value);
+    }
+    end_item();
+}
+
+void cbor_writer::put(bool value) {
+    put(value ? cbor::simple(cbor::SIMPLE_TRUE) : cbor::simple(cbor::SIMPLE_FALSE));
+}
+
+void cbor_writer::put(float value) {
+    put(double(value));
+}
+
+void cbor_writer::put(double value) {
+    begin_item();
+    if (m_buffer) {
+        vector_sink sink(*m_buffer);
+        write_float(sink, value);
+    } else {
+        stream_sink sink(*m_stream);
+        write_float(sink, value);
+    }
+    end_item();
+}
+
+void cbor_writer::put(std::nullptr_t) {
+    put(cbor::null);
+}
+
+void cbor_writer::put(cbor::simple value) {
+    begin_item();
+    if (m_buffer) {
+        vector_sink sink(*m_buffer);
+        write_uint8(sink, 7, value & 255);
+    } else {
+        stream_sink sink(*m_stream);
+        write_uint8(sink, 7, value & 255);
+    }
+    end_item();
+}
+
+void cbor_writer::put(const char *value) {
+    put(value, std::strlen(value));
+}
+
+void cbor_writer::put(const char *value, size_t size) {
+    begin_item();
+    header(3, size);
+    raw(value, size);
+    end_item();
+}
+
+void cbor_writer::put(const cbor::string &value) {
+    put(value.data(), value.size());
+}
+
+void cbor_writer::put(const cbor::binary &value) {
+    put_bytes(value.data(), value.size());
+}
+
+void cbor_writer::put_bytes(const unsigned char *data, size_t size) {
+    begin_item();
+    header(2, size);
+    raw(data, size);
+    end_item();
+}
+
+template <typename Type>
+void cbor_writer::put_typed(const Type *data, size_t count, bool big_endian) {
+    tag(big_endian ? typed_array_tag<Type>::big : host_typed_array_tag<Type>());
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    size_t size = count * sizeof(Type);
+    if (sizeof(Type) == 1 || big_endian != host_little_endian) {
+        put_bytes(bytes, size);
+        return;
+    }
+    // Swap through a small buffer rather than copying the whole array
+    begin_item();
+    header(2, size);
+    unsigned char buffer[4096];
+    for (size_t offset = 0; offset != size; ) {
+        size_t chunk = std::min(size - offset, sizeof(buffer));
+        std::memcpy(buffer, bytes + offset, chunk);
+        swap_bytes(buffer, chunk, sizeof(Type));
+        raw(buffer, chunk);
+        offset += chunk;
+    }
+    end_item();
+}
+
+template void cbor_writer::put_typed(const uint8_t *, size_t, bool);
+template void cbor_writer::put_typed(const uint16_t *, size_t, bool);
+template void cbor_writer::put_typed(const uint32_t *, size_t, bool);
+template void cbor_writer::put_typed(const uint64_t *, size_t, bool);
+template void cbor_writer::put_typed(const int8_t *, size_t, bool);
+template void cbor_writer::put_typed(const int16_t *, size_t, bool);
+template void cbor_writer::put_typed(const int32_t *, size_t, bool);
+template void cbor_writer::put_typed(const int64_t *, size_t, bool);
+template void cbor_writer::put_typed(const float *, size_t, bool);
+template void cbor_writer::put_typed(const double *, size_t, bool);
+
+void cbor_writer::put(const cbor &value) {
+    begin_item();
+    if (m_buffer) {
+        cbor::encode_into(value, *m_buffer);
+    } else {
+        value.write(*m_stream);
+    }
+    end_item();
+}
+
+bool cbor_writer::complete() const {
+    return m_open.empty();
+}
+
+void cbor_writer::put_key(const cbor_key &key) {
+    begin_item();
+    raw(key.header, key.header_size);
+    raw(key.name, key.size);
+    end_item();
+}
+
+cbor_reader::cbor_reader(const unsigned char *data, size_t size) : m_begin(data), m_pos(data), m_end(data + size),
+    m_failed(false) { }
+
+cbor_reader::cbor_reader(const cbor::binary &data) : cbor_reader(data.data(), data.size()) { }
+
+cbor::type_t cbor_reader::type() const {
+    return cbor_view(m_pos, m_end - m_pos).type();
+}
+
+bool cbor_reader::fail() {
+    m_failed = true;
+    return false;
+}
+
+// Takes the header of the next item if it has the given major type.
+bool cbor_reader::header(int major, int &minor, uint64_t &value) {
+    int found;
+    const unsigned char *next = m_failed ? nullptr : parse_header(m_pos, m_end, found, minor, value);
+    if (!next || found != major) {
+        return fail();
+    }
+    m_pos = next;
+    return true;
+}
+
+// Reads the chunks of an indefinite-length string up to its break.
+bool cbor_reader::chunks(int major, cbor::string *text, cbor::binary *bytes) {
+    while (m_pos != m_end && *m_pos != 255) {
+        int minor;
+        uint64_t size;
+        if (!header(major, minor, size) || minor == 31 || size > remaining()) {
+            return fail();
+        }
+        if (text) {
+            text->append(reinterpret_cast<const char *>(m_pos), size);
+        } else {
+            bytes->insert(bytes->end(), m_pos, m_pos + size);
+        }
+        m_pos += size;
+    }
+    if (m_pos == m_end) {
+        return fail();
+    }
+    ++m_pos;
+    return true;
+}
+
+bool cbor_reader::read(bool &value) {
+    if (m_failed || m_pos == m_end || (*m_pos != 0xf4 && *m_pos != 0xf5)) {
+        return fail();
+    }
+    value = *m_pos++ == 0xf5;
+    return true;
+}
+
+bool cbor_reader::read(uint64_t &value) {
+    int minor;
+    return header(0, minor, value) && (minor != 31 || fail());
+}
+
+bool cbor_reader::read(int64_t &value) {
+    int major = m_pos != m_end ? *m_pos >> 5 : 0;
+    int minor;
+    uint64_t argument;
+    if (!header(major == 1 ? 1 : 0, minor, argument) || minor == 31 || argument > uint64_t(INT64_MAX)) {
+        return fail();
+    }
+    value = major == 1 ? -1 - int64_t(argument) : int64_t(argument);
+    return true;
+}
+
+bool cbor_reader::read(double &value) {
+    int major = m_pos != m_end ? *m_pos >> 5 : 0;
+    int minor;
+    uint64_t argument;
+    if (major == 7) {
+        if (!header(7, minor, argument) || minor < 25 || minor > 27) {
+            return fail();
+        }
+        value = decode_float(minor, argument);
+        return true;
+    }
+    if (!header(major == 1 ? 1 : 0, minor, argument) || minor == 31) {
+        return fail();
+    }
+    value = major == 1 ? -1 - double(argument) : double(argument);
+    return true;
+}
+
+bool cbor_reader::read(cbor::string &value) {
+    int minor;
+    uint64_t size;
+    if (!header(3, minor, size)) {
+        return false;
+    }
+    value.clear();
+    if (minor == 31) {
+        return chunks(3, &value, nullptr);
+    }
+    if (size > remaining()) {
+        return fail();
+    }
+    value.assign(reinterpret_cast<const char *>(m_pos), size);
+    m_pos += size;
+    return true;
+}
+
+bool cbor_reader::read(cbor::binary &value) {
+    int minor;
+    uint64_t size;
+    if (!header(2, minor, size)) {
+        return false;
+    }
+    value.clear();
+    if (minor == 31) {
+        return chunks(2, nullptr, &value);
+    }
+    if (size > remaining()) {
+        return fail();
+    }
+    value.assign(m_pos, m_pos + size);
+    m_pos += size;
+    return true;
+}
+
+bool cbor_reader::read(cbor &value) {
+    const unsigned char *end = m_failed ? nullptr : skip_item(m_pos, m_end);
+    if (!end) {
+        return fail();
+    }
+    value = cbor::decode(m_pos, end - m_pos);
+    m_pos = end;
+    return true;
+}
+
+bool cbor_reader::read_text(const char *&data, size_t &size, cbor::string &buffer) {
+    int minor;
+    uint64_t length;
+    if (!header(3, minor, length)) {
+        return false;
+    }
+    if (minor == 31) {
+        buffer.clear();
+        if (!chunks(3, &buffer, nullptr)) {
+            return false;
+        }
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+    }
+    if (length > remaining()) {
+        return fail();
+    }
+    data = reinterpret_cast<const char *>(m_pos);
+    size = length;
+    m_pos += length;
+    return true;
+}
+
+bool cbor_reader::read_null() {
+    if (m_failed || m_pos == m_end || (*m_pos != 0xf6 && *m_pos != 0xf7)) {
+        return false;
+    }
+    ++m_pos;
+    return true;
+}
+
+// Indefinite-length containers are given a size of UINT64_MAX, which no
+// definite one that fits in the input can have
+bool cbor_reader::begin_array(uint64_t &size) {
+    int minor;
+    if (!header(4, minor, size)) {
+        return false;
+    }
+    if (minor == 31) {
+        size = UINT64_MAX;
+    } else if (size > remaining()) {
+        return fail();
+    }
+    return true;
+}
+
+bool cbor_reader::begin_map(uint64_t &size) {
+    int minor;
+    if (!header(5, minor, size)) {
+        return false;
+    }
+    if (minor == 31) {
+        size = UINT64_MAX;
+    } else if (size > remaining() / 2) {
+        return fail();
+    }
+    return true;
+}
+
+bool cbor_reader::next(uint64_t &size) {
+    if (m_failed) {
+        return false;
+    }
+    if (size == UINT64_MAX) {
+        if (m_pos == m_end) {
+            return fail();
+        }
+        if (*m_pos == 255) {
+            ++m_pos;
+            return false;
+        }
+        return true;
+    }
+    if (size == 0) {
+        return false;
+    }
+    --size;
+    return true;
+}
+
+bool cbor_reader::skip() {
+    const unsigned char *end = m_failed ? nullptr : skip_item(m_pos, m_end);
+    if (!end) {
+        return fail();
+    }
+    m_pos = end;
+    return true;
+}
+
+bool cbor_reader::failed() const {
+    return m_failed;
+}
+
+bool cbor_reader::at_end() const {
+    return m_pos == m_end;
+}
+
+size_t cbor_reader::offset() const {
+    return m_pos - m_begin;
+}
+
+size_t cbor_reader::remaining() const {
+    return m_end - m_pos;
+}
+
+cbor_sequence_reader::cbor_sequence_reader(const unsigned char *data, size_t size) :
+    cbor_sequence_reader(data, size, cbor::decode_options()) { }
+
+cbor_sequence_reader::cbor_sequence_reader(const unsigned char *data, size_t size,
+    const cbor::decode_options &options) : m_pos(data), m_end(data + size), m_stream(nullptr), m_options(options),
+    m_offset(0), m_error(false) { }
+
+cbor_sequence_reader::cbor_sequence_reader(std::istream &in) : cbor_sequence_reader(in, cbor::decode_options()) { }
+
+cbor_sequence_reader::cbor_sequence_reader(std::istream &in, const cbor::decode_options &options) : m_pos(nullptr),
+    m_end(nullptr), m_stream(&in), m_options(options), m_offset(0), m_error(false) {
+    // The buffer is overwritten by the next read, so nothing may point into it
+    m_options.borrow = false;
+}
+
+bool cbor_sequence_reader::next(cbor &item) {
+    while (!m_error) {
+        if (m_pos == m_end && !fill()) {
+            return false;
+        }
+        memory_source source(m_pos, m_end - m_pos);
+        uint64_t nodes = 0;
+        if (item.read_item(source, m_options, nodes, 0)) {
+            size_t size = source.position() - m_pos;
+            if (size > m_options.max_bytes) {
+                break;
+            }
+            m_pos = source.position();
+            m_offset += size;
+            return true;
+        }
+        // An item that ran into the end of the buffer is decoded again once
+        // more of the stream is in
+        if (source.position() != m_end || uint64_t(m_end - m_pos) >= m_options.max_bytes || !fill()) {
+            break;
+        }
+    }
+    m_error = true;
+    return false;
+}
+
+cbor::array cbor_sequence_reader::next_batch(size_t count) {
+    cbor::array out;
+    next_batch(count, out);
+    return out;
+}
+
+size_t cbor_sequence_reader::next_batch(size_t count, cbor::array &out) {
+    out.clear();
+    while (out.size() != count) {
+        out.emplace_back();
+        if (!next(out.back())) {
+            out.pop_back();
+            break;
+        }
+    }
+    return out.size();
+}
+
+bool cbor_sequence_reader::error() const {
+    return m_error;
+}
+
+uint64_t cbor_sequence_reader::offset() const {
+    return m_offset;
+}
+
+// Moves what is left unread to the front of the buffer and reads another
+// block after it. Blocks are at least as large as what is left, so an item
+// larger than the buffer takes a number of reads logarithmic in its size.
+bool cbor_sequence_reader::fill() {
+    if (!m_stream || !m_stream->good()) {
+        return false;
+    }
+    size_t unread = m_end - m_pos;
+    if (unread && m_pos != m_buffer.data()) {
+        std::memmove(m_buffer.data(), m_pos, unread);
+    }
+    size_t block = std::max(stream_chunk_size, unread);
+    m_buffer.resize(unread + block);
+    m_stream->read(reinterpret_cast<char *>(m_buffer.data() + unread), block);
+    size_t got = m_stream->gcount();
+    m_buffer.resize(unread + got);
+    m_pos = m_buffer.data();
+    m_end = m_pos + m_buffer.size();
+    return got != 0;
+}
+
+cbor_sequence_writer::cbor_sequence_writer(cbor::binary &out) : m_out(&out), m_stream(nullptr), m_flush_size(0),
+    m_count(0) { }
+
+cbor_sequence_writer::cbor_sequence_writer(std::ostream &out, size_t flush_size) : m_out(&m_buffer),
+    m_stream(&out), m_flush_size(flush_size), m_count(0) { }
+
+cbor_sequence_writer::~cbor_sequence_writer() {
+    flush();
+}
+
+void cbor_sequence_writer::write(const cbor &item) {
+    cbor::encode_into(item, *m_out);
+    ++m_count;
+    if (m_stream && m_buffer.size() >= m_flush_size) {
+        flush();
+    }
+}
+
+void cbor_sequence_writer::write_batch(const cbor::array &items) {
+    for (const cbor &item : items) {
+        write(item);
+    }
+}
+
+void cbor_sequence_writer::write_encoded(const unsigned char *data, size_t size) {
+    m_out->insert(m_out->end(), data, data + size);
+    ++m_count;
+    if (m_stream && m_buffer.size() >= m_flush_size) {
+        flush();
+    }
+}
+
+void cbor_sequence_writer::flush() {
+    if (m_stream && !m_buffer.empty()) {
+        m_stream->write(reinterpret_cast<const char *>(m_buffer.data()), m_buffer.size());
+        m_buffer.clear();
+    }
+}
+
+uint64_t cbor_sequence_writer::count() const {
+    return m_count;
+}
+
+namespace {
+
+// Items a container header is trusted for before they arrive. Nested headers
+// could otherwise each reserve their full claimed size up front.
+const size_t decoder_reserve_items = 64;
+
+} // namespace
+
+// Builds the tree of a cbor_decoder from the events of its parser. Each open
+// array, map and tag is a frame holding the items it has so far, and a byte
+// or text string is gathered until its end. Once an event breaks the decode
+// options the rest are ignored.
+class cbor_decoder::builder : public cbor_handler {
+public:
+    builder(const cbor::decode_options &options, const cbor_parser &parser) : m_options(options), m_parser(parser),
+        m_chunk_start(0), m_nodes(0), m_failed(false) { }
+
+    void reset() {
+        m_stack.clear();
+        m_bytes.clear();
+        m_text.clear();
+        m_chunk_start = 0;
+        m_result = cbor();
+        m_nodes = 0;
+        m_failed = false;
+    }
+
+    bool failed() const {
+        return m_failed;
+    }
+
+    cbor &result() {
+        return m_result;
+    }
+
+    void begin_array(uint64_t size, bool indefinite) override {
+        if (begin_item() && check(indefinite || size <= m_options.max_items)) {
+            m_stack.push_back(frame(cbor::TYPE_ARRAY, 0));
+            m_stack.back().items.reserve(indefinite ? 0 : std::min<uint64_t>(size, decoder_reserve_items));
+        }
+    }
+
+    void end_array() override {
+        if (!m_failed) {
+            cbor::array items = std::move(m_stack.back().items);
+            m_stack.pop_back();
+            add(cbor(std::move(items)));
+        }
+    }
+
+    void begin_map(uint64_t size, bool indefinite) override {
+        if (begin_item() && check(indefinite || size <= m_options.max_items)) {
+            m_stack.push_back(frame(cbor::TYPE_MAP, 0));
+            m_stack.back().pairs.reserve(indefinite ? 0 : std::min<uint64_t>(size, decoder_reserve_items));
+        }
+    }
+
+    void end_map() override {
+        if (!m_failed) {
+            std::vector<cbor::map::value_type> &pairs = m_stack.back().pairs;
+            cbor::map items(std::make_move_iterator(pairs.begin()), std::make_move_iterator(pairs.end()));
+            m_stack.pop_back();
+            add(cbor(std::move(items)));
+        }
+    }
+
+    void unsigned_integer(uint64_t value) override {
+        if (begin_item()) {
+            add(cbor(value));
+        }
+    }
+
+    void negative_integer(uint64_t value) override {
+        if (begin_item()) {
+            cbor item;
+            item.m_type = cbor::TYPE_NEGATIVE;
+            item.m_integer = value;
+            add(std::move(item));
+        }
+    }
+
+    void begin_binary(uint64_t size, bool indefinite) override {
+        if (begin_item() && check(indefinite || size <= m_options.max_string_length)) {
+            m_bytes.reserve(indefinite ? 0 : std::min<uint64_t>(size, stream_chunk_size));
+        }
+    }
+
+    void binary_chunk(const unsigned char *data, size_t size) override {
+        if (!m_failed && check(size <= m_options.max_string_length - m_bytes.size())) {
+            m_bytes.insert(m_bytes.end(), data, data + size);
+        }
+    }
+
+    void end_binary() override {
+        if (!m_failed) {
+            add(cbor(std::move(m_bytes)));
+            m_bytes.clear();
+        }
+    }
+
+    void begin_string(uint64_t size, bool indefinite) override {
+        if (begin_item() && check(indefinite || size <= m_options.max_string_length)) {
+            m_text.reserve(indefinite ? 0 : std::min<uint64_t>(size, stream_chunk_size));
+            m_chunk_start = 0;
+        }
+    }
+
+    // Pieces come wherever the input happened to be split, so the text is
+    // validated a chunk of the encoding at a time once the chunk is complete,
+    // as read_item does
+    void string_chunk(const char *data, size_t size) override {
+        if (!m_failed && check(size <= m_options.max_string_length - m_text.size())) {
+            m_text.append(data, size);
+            if (m_parser.chunk_remaining() == 0) {
+                check(!m_options.strict_utf8 || valid_utf8(reinterpret_cast<const unsigned char *>(m_text.data())
+                    + m_chunk_start, m_text.size() - m_chunk_start));
+                m_chunk_start = m_text.size();
+            }
+        }
+    }
+
+    void end_string() override {
+        if (!m_failed) {
+            add(cbor(std::move(m_text)));
+            m_text.clear();
+        }
+    }
+
+    void tag(uint64_t value) override {
+        if (begin_item()) {
+            m_stack.push_back(frame(cbor::TYPE_TAGGED, value));
+        }
+    }
+
+    void simple(unsigned value) override {
+        if (begin_item()) {
+            add(cbor(cbor::simple(value)));
+        }
+    }
+
+    void floating(double value) override {
+        if (begin_item()) {
+            add(cbor(value));
+        }
+    }
+
+private:
+    struct frame {
+        frame(cbor::type_t type, uint64_t tag) : type(type), tag(tag), has_key(false) { }
+
+        cbor::type_t type;
+        uint64_t tag;
+        cbor::array items;
+        std::vector<cbor::map::value_type> pairs;
+        cbor key;
+        bool has_key;
+    };
+
+    const cbor::decode_options &m_options;
+    const cbor_parser &m_parser;
+    std::vector<frame> m_stack;
+    cbor::binary m_bytes;
+    cbor::string m_text;
+    // Where the chunk of m_text being received starts.
+    size_t m_chunk_start;
+    cbor m_result;
+    uint64_t m_nodes;
+    bool m_failed;
+
+    bool check(bool condition) {
+        if (!condition) {
+            m_failed = true;
+        }
+        return condition;
+    }
+
+    bool begin_item() {
+        if (m_failed || !check(m_stack.size() <= m_options.max_depth && m_nodes != m_options.max_nodes)) {
+            return false;
+        }
+        ++m_nodes;
+        return true;
+    }
+
+    // Puts a complete item in its container, closing the tags waiting for it.
+    void add(cbor item) {
+        while (!m_stack.empty() && m_stack.back().type == cbor::TYPE_TAGGED) {
+            item = cbor::tagged(m_stack.back().tag, std::move(item));
+            item.typed_array_to_host(false);
+            m_stack.pop_back();
+        }
+        if (m_stack.empty()) {
+            m_result = std::move(item);
+            return;
+        }
+        frame &top = m_stack.back();
+        if (top.type == cbor::TYPE_ARRAY) {
+            if (check(top.items.size() != m_options.max_items)) {
+                top.items.push_back(std::move(item));
+            }
+        } else if (!top.has_key) {
+            top.key = std::move(item);
+            top.has_key = true;
+        } else if (check(top.pairs.size() != m_options.max_items)) {
+            top.pairs.emplace_back(std::move(top.key), std::move(item));
+            top.has_key = false;
+        }
+    }
+};
+
+cbor_decoder::cbor_decoder() : cbor_decoder(cbor::decode_options()) { }
+
+cbor_decoder::cbor_decoder(const cbor::decode_options &options) : m_options(options),
+    m_builder(new builder(m_options, m_parser)), m_parser(*m_builder), m_consumed(0), m_status(STATUS_NEED_MORE) { }
+
+cbor_decoder::~cbor_decoder() { }
+
+cbor_decoder::status_t cbor_decoder::feed(const unsigned char *data, size_t size) {
+    m_consumed = 0;
+    if (m_status != STATUS_NEED_MORE) {
+        return m_status;
+    }
+    m_consumed = m_parser.feed(data, std::min<uint64_t>(size, m_options.max_bytes - m_parser.position()));
+    if (m_parser.failed() || m_builder->failed()) {
+        m_status = STATUS_ERROR;
+    } else if (m_parser.done()) {
+        m_status = STATUS_COMPLETE;
+    } else if (m_parser.position() == m_options.max_bytes) {
+        m_status = STATUS_ERROR;
+    }
+    return m_status;
+}
+
+cbor_decoder::status_t cbor_decoder::status() const {
+    return m_status;
+}
+
+size_t cbor_decoder::consumed() const {
+    return m_consumed;
+}
+
+uint64_t cbor_decoder::position() const {
+    return m_parser.position();
+}
+
+const cbor &cbor_decoder::item() const {
+    return m_builder->result();
+}
+
+cbor cbor_decoder::take() {
+    cbor item = std::move(m_builder->result());
+    reset();
+    return item;
+}
+
+void cbor_decoder::reset() {
+    m_builder->reset();
+    m_parser.reset();
+    m_consumed = 0;
+    m_status = STATUS_NEED_MORE;
 }
 
 void swap(cbor& left, cbor& right) {
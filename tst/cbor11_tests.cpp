@@ -1,7 +1,17 @@
 #include "cbor11.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 bool test_incomplete_data()
 {
@@ -40,6 +50,1427 @@ bool test_serialization_deserialization()
     return !output.is_undefined();
 }
 
+bool test_decode_from_memory()
+{
+    const cbor item = cbor::array {
+            1,
+            -500000,
+            4294967295u,
+            "text",
+            cbor::binary {0x01, 0x02, 0x03},
+            1.2,
+            -2.5f
+    };
+    cbor::binary data = cbor::encode(item);
+    if (!cbor::validate(data.data(), data.size())) {
+        return false;
+    }
+    const auto output = cbor::decode(data.data(), data.size());
+    if (!output.is_array() || output.to_array().size() != 7) {
+        return false;
+    }
+    const auto values = output.to_array();
+    if (values[2].to_unsigned() != 4294967295u || values[3].to_string() != "text") {
+        return false;
+    }
+    if (values[5].to_float() != 1.2 || values[6].to_float() != -2.5) {
+        return false;
+    }
+
+    // Truncated input and trailing bytes are both rejected
+    if (cbor::validate(data.data(), data.size() - 1) || !cbor::decode(data.data(), data.size() - 1).is_undefined()) {
+        return false;
+    }
+    data.push_back(0x00);
+    return !cbor::validate(data.data(), data.size());
+}
+
+bool test_encode_into_buffer()
+{
+    const cbor item = cbor::map {
+            {"small", 23},
+            {"byte", 255},
+            {"short", 65535},
+            {"word", 4294967295u},
+            {"long", uint64_t(1) << 40},
+            {"negative", -70000},
+            {"float", 0.5f},
+            {"double", 1.2},
+            {"tagged", cbor::tagged(32, "http://example.com")},
+            {"simple", cbor::simple (100)},
+            {"blob", cbor::binary (300, 0xab)}
+    };
+
+    // The buffer encoder must produce exactly what the stream writer does
+    std::ostringstream stream;
+    item.write(stream);
+    const std::string expected = stream.str();
+    const cbor::binary data = cbor::encode(item);
+    if (cbor::encoded_size(item) != expected.size() || data != cbor::binary(expected.begin(), expected.end())) {
+        return false;
+    }
+
+    // encode_into appends and reuses whatever capacity the caller provides
+    cbor::binary out {0x01};
+    cbor::encode_into(item, out);
+    if (out.size() != data.size() + 1 || !std::equal(data.begin(), data.end(), out.begin() + 1)) {
+        return false;
+    }
+
+    // Empty strings joined from chunks have no storage to copy from
+    const cbor::binary chunked {0x82, 0x5f, 0xff, 0x7f, 0xff};
+    const cbor::binary empty {0x82, 0x40, 0x60};
+    if (cbor::encode(cbor::decode(chunked)) != empty) {
+        return false;
+    }
+
+    unsigned char buffer[512];
+    if (cbor::encode_into(item, buffer, data.size() - 1) != 0) {
+        return false;
+    }
+    return cbor::encode_into(item, buffer, sizeof(buffer)) == data.size() && std::equal(data.begin(), data.end(), buffer);
+}
+
+bool test_move_semantics()
+{
+    static_assert(std::is_nothrow_move_constructible<cbor>::value, "containers of cbor must move, not copy, on growth");
+    static_assert(std::is_nothrow_move_assignable<cbor>::value, "cbor move assignment must not throw");
+
+    cbor::string text(64, 'x');
+    cbor::array elements {1, 2, 3};
+    cbor item = cbor::array {
+            cbor(std::move(text)),
+            cbor(std::move(elements)),
+            cbor(cbor::map {{"key", "value"}}),
+            cbor::tagged(1, cbor(cbor::binary {0x01, 0x02}))
+    };
+    cbor moved(std::move(item));
+    if (!item.is_undefined() || !moved.is_array()) {
+        return false;
+    }
+    const cbor::array values = moved.to_array();
+    if (values[0].to_string() != cbor::string(64, 'x') || values[1].to_array().size() != 3) {
+        return false;
+    }
+    if (values[2].to_map().at("key").to_string() != "value" || values[3].child().to_binary().size() != 2) {
+        return false;
+    }
+
+    // Deeply nested input decodes without copying each level into its parent
+    cbor::binary nested(2000, 0x81);
+    nested.push_back(0x00);
+    const cbor decoded = cbor::decode(nested);
+    return decoded.is_array() && cbor::encode(decoded) == nested;
+}
+
+bool test_decode_into_arena()
+{
+    const cbor item = cbor::array {
+            "short",
+            cbor::string(100, 'x'),
+            cbor::binary {0x01, 0x02, 0x03},
+            cbor::map {{"nested", cbor::array {1, "two", 3.0}}},
+            cbor::tagged(24, cbor::binary {0xff})
+    };
+    const cbor::binary data = cbor::encode(item);
+
+    cbor copy;
+    {
+        cbor::arena arena(256);
+        const cbor decoded = cbor::decode(data, arena);
+        if (!decoded.is_array() || cbor::encode(decoded) != data) {
+            return false;
+        }
+        if (arena.bytes_allocated() == 0 || arena.block_count() == 0) {
+            return false;
+        }
+        if (decoded.to_array()[1].to_string() != cbor::string(100, 'x')) {
+            return false;
+        }
+        copy = decoded;
+    }
+
+    // Copies own their payloads and survive the arena
+    if (cbor::encode(copy) != data) {
+        return false;
+    }
+
+    // Indefinite-length strings are joined into a single arena allocation
+    const unsigned char chunked[] = {0x7f, 0x62, 'a', 'b', 0x61, 'c', 0xff};
+    cbor::arena arena;
+    const cbor text = cbor::decode(chunked, sizeof(chunked), arena);
+    if (text.to_string() != "abc") {
+        return false;
+    }
+    const unsigned char truncated[] = {0x5a, 0xff, 0xff, 0xff, 0xff, 0x00};
+    return cbor::decode(truncated, sizeof(truncated), arena).is_undefined();
+}
+
+bool test_view()
+{
+    const cbor item = cbor::map {
+            {"id", 42},
+            {"name", "sensor"},
+            {"readings", cbor::array {1.5, -3, cbor::binary {0x01, 0x02}}},
+            {"meta", cbor::map {{"route", "/a/b"}, {7, "seven"}}},
+            {"stamp", cbor::tagged(1, 1500000000)}
+    };
+    const cbor::binary data = cbor::encode(item);
+    const cbor_view view(data);
+    if (!view.is_map() || view.size() != 5 || view.encoded_size() != data.size()) {
+        return false;
+    }
+    if (view.find("id").to_unsigned() != 42 || view["name"].to_string() != "sensor") {
+        return false;
+    }
+    const cbor_view readings = view.find("readings");
+    if (!readings.is_array() || readings.size() != 3 || readings[0].to_float() != 1.5) {
+        return false;
+    }
+    if (readings[1].to_signed() != -3 || readings[2].to_binary() != cbor::binary {0x01, 0x02} || readings[3].valid()) {
+        return false;
+    }
+    if (view["meta"].find(cbor(7)).to_string() != "seven" || view["meta"]["route"].to_string() != "/a/b") {
+        return false;
+    }
+    if (view["stamp"].tag() != 1 || view["stamp"].child().to_unsigned() != 1500000000) {
+        return false;
+    }
+    if (view.find("missing").valid() || !view.find("missing").is_undefined()) {
+        return false;
+    }
+    if (cbor::encode(readings.to_cbor()) != cbor::binary(readings.data(), readings.data() + readings.encoded_size())) {
+        return false;
+    }
+
+    // Indefinite-length containers are navigated by their break markers
+    const unsigned char indefinite[] = {0xbf, 0x61, 'a', 0x9f, 0x01, 0x02, 0xff, 0x61, 'b', 0x7f, 0x61, 'x', 0x61, 'y', 0xff, 0xff};
+    const cbor_view nested(indefinite, sizeof(indefinite));
+    if (nested.size() != 2 || nested["a"].size() != 2 || nested["a"][1].to_unsigned() != 2 || nested["a"][2].valid()) {
+        return false;
+    }
+    if (nested["b"].to_string() != "xy" || nested.encoded_size() != sizeof(indefinite)) {
+        return false;
+    }
+
+    // Malformed input never reads past the buffer
+    return cbor_view(data.data(), data.size() - 1).encoded_size() == 0;
+}
+
+// Writes every event it receives as a token so traces can be compared
+class trace_handler : public cbor_handler {
+public:
+    std::string trace;
+    size_t binary_size = 0;
+
+    void begin_array(uint64_t size, bool indefinite) override { trace += indefinite ? "[_ " : "[" + std::to_string(size) + " "; }
+    void end_array() override { trace += "] "; }
+    void begin_map(uint64_t size, bool indefinite) override { trace += indefinite ? "{_ " : "{" + std::to_string(size) + " "; }
+    void end_map() override { trace += "} "; }
+    void map_key() override { trace += "key:"; }
+    void unsigned_integer(uint64_t value) override { trace += std::to_string(value) + " "; }
+    void negative_integer(uint64_t value) override { trace += "-1-" + std::to_string(value) + " "; }
+    void begin_binary(uint64_t, bool) override { binary_size = 0; }
+    void binary_chunk(const unsigned char *, size_t size) override { binary_size += size; }
+    void end_binary() override { trace += "h'" + std::to_string(binary_size) + "' "; }
+    void begin_string(uint64_t, bool) override { trace += "\""; }
+    void string_chunk(const char *data, size_t size) override { trace.append(data, size); }
+    void end_string() override { trace += "\" "; }
+    void tag(uint64_t value) override { trace += "tag" + std::to_string(value) + " "; }
+    void simple(unsigned value) override { trace += "simple" + std::to_string(value) + " "; }
+    void floating(double value) override { trace += std::to_string(value) + " "; }
+};
+
+bool test_event_parser()
+{
+    const unsigned char indefinite[] = {0xbf, 0x61, 'a', 0x9f, 0x01, 0x20, 0xff, 0x61, 'b', 0x5f, 0x41, 0x00, 0x42, 0x01, 0x02, 0xff, 0xff};
+    const std::string expected = "{_ key:\"a\" [_ 1 -1-0 ] key:\"b\" h'3' } ";
+    trace_handler whole;
+    if (!cbor_parser::parse(indefinite, sizeof(indefinite), whole) || whole.trace != expected) {
+        return false;
+    }
+
+    // Feeding one byte at a time produces the same events
+    trace_handler pieces;
+    cbor_parser parser(pieces);
+    for (size_t i = 0; i != sizeof(indefinite); ++i) {
+        if (parser.done() || parser.feed(indefinite + i, 1) != 1) {
+            return false;
+        }
+    }
+    if (!parser.done() || pieces.trace != expected) {
+        return false;
+    }
+
+    // Reading from a stream stops exactly at the end of the item
+    const cbor item = cbor::array {cbor::tagged(1, 2), "text", 0.5, true, cbor::map {{1, cbor::binary(5000, 7)}}};
+    std::stringstream stream;
+    item.write(stream);
+    cbor(99).write(stream);
+    trace_handler streamed;
+    if (!cbor_parser::parse(stream, streamed) || streamed.trace != "[5 tag1 2 \"text\" 0.500000 simple21 {1 key:1 h'5000' } ] ") {
+        return false;
+    }
+    cbor next;
+    if (!next.read(stream) || next.to_unsigned() != 99) {
+        return false;
+    }
+
+    // Stray breaks and maps with a dangling key are errors at their position
+    const unsigned char stray[] = {0x82, 0x01, 0xff};
+    const unsigned char dangling[] = {0xbf, 0x01, 0xff};
+    trace_handler ignored;
+    cbor_parser broken(ignored);
+    broken.feed(stray, sizeof(stray));
+    if (!broken.failed() || broken.position() != 2) {
+        return false;
+    }
+    return !cbor_parser::parse(dangling, sizeof(dangling), ignored);
+}
+
+bool test_writer()
+{
+    const cbor item = cbor::array {
+            12,
+            -70000,
+            "Hello",
+            cbor::binary {0xff, 0xff},
+            cbor::map {{"CH", "Switzerland"}},
+            cbor::array {},
+            cbor::tagged(32, "http://example.com"),
+            cbor::simple (0),
+            false,
+            nullptr,
+            1.2,
+            0.5f
+    };
+
+    // Building the same document event by event gives the same bytes
+    cbor::binary out;
+    cbor_writer writer(out);
+    writer.begin_array(12);
+    writer.put(12);
+    writer.put(-70000);
+    writer.put("Hello");
+    writer.put(cbor::binary {0xff, 0xff});
+    writer.begin_map(1);
+    writer.put("CH");
+    writer.put(cbor::string("Switzerland"));
+    writer.begin_array(0);
+    writer.tag(32);
+    writer.put("http://example.com", 18);
+    writer.put(cbor::simple (0));
+    writer.put(false);
+    writer.put(nullptr);
+    writer.put(1.2);
+    if (writer.complete()) {
+        return false;
+    }
+    writer.put(0.5f);
+    if (!writer.complete() || out != cbor::encode(item)) {
+        return false;
+    }
+
+    // Indefinite-length containers are closed explicitly
+    std::ostringstream stream;
+    cbor_writer streamed(stream);
+    streamed.begin_map();
+    streamed.put("a");
+    streamed.begin_array();
+    streamed.put(uint64_t(1) << 40);
+    streamed.put(item);
+    streamed.end();
+    streamed.end();
+    const std::string bytes = stream.str();
+    const cbor_view view(reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size());
+    return streamed.complete() && bytes[0] == '\xbf' && view.encoded_size() == bytes.size() && view.find("a")[1].size() == 12;
+}
+
+bool test_validate_offsets()
+{
+    struct {
+        cbor::binary data;
+        size_t offset;
+    } malformed[] = {
+        { {0x1c}, 0 },                          // reserved minor value
+        { {0x82, 0x01}, 2 },                    // truncated array
+        { {0x82, 0x01, 0x02, 0x03}, 3 },        // trailing bytes
+        { {0x5f, 0x61, 'a', 0xff}, 1 },         // text chunk in a byte string
+        { {0x9f, 0x01}, 2 },                    // missing break
+        { {0x81, 0xff}, 1 },                    // break inside a definite array
+        { {0xbf, 0x01, 0xff}, 2 },              // key without a value
+        { {0xf8, 0x10}, 0 },                    // two-byte simple value below 32
+        { {0x1f}, 0 },                          // indefinite-length integer
+        { {0x9b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00}, 10 }
+    };
+    for (auto&& test : malformed) {
+        size_t offset = 12345;
+        if (cbor::validate(test.data.data(), test.data.size(), offset) || offset != test.offset) {
+            return false;
+        }
+    }
+
+    // Definite nesting costs no stack, indefinite nesting is capped at 128
+    // levels even where decoding would accept more
+    cbor::binary deep(100000, 0x81);
+    deep.push_back(0x00);
+    size_t offset = 0;
+    if (!cbor::validate(deep.data(), deep.size(), offset)) {
+        return false;
+    }
+    cbor::binary indefinite(256);
+    std::fill(indefinite.begin(), indefinite.begin() + 128, 0x9f);
+    std::fill(indefinite.begin() + 128, indefinite.end(), 0xff);
+    if (!cbor::validate(indefinite.data(), indefinite.size()) || cbor::decode(indefinite).is_undefined()) {
+        return false;
+    }
+    indefinite.insert(indefinite.begin(), 0x9f);
+    indefinite.push_back(0xff);
+    return !cbor::validate(indefinite.data(), indefinite.size(), offset) && offset == 128
+        && !cbor::decode(indefinite).is_undefined();
+}
+
+bool test_strict_utf8()
+{
+    struct sample { std::string bytes; bool valid; };
+    sample samples[] = {
+        {"\xc3\xa9", true},
+        {"\xe2\x82\xac", true},
+        {"\xf0\x9f\x98\x80", true},
+        {"\xf4\x8f\xbf\xbf", true},
+        {"\xc0\xaf", false},             // overlong
+        {"\xe0\x80\xaf", false},         // overlong
+        {"\xed\xa0\x80", false},         // surrogate
+        {"\xf4\x90\x80\x80", false},     // beyond U+10FFFF
+        {"\xe2\x82", false},             // truncated
+        {"\x80", false},                 // stray continuation
+        {"\xff", false}
+    };
+    cbor::decode_options strict;
+    strict.strict_utf8 = true;
+    cbor::arena arena;
+    cbor::decode_options strict_arena = strict;
+    strict_arena.arena = &arena;
+
+    // Move each sample across the SIMD block boundaries
+    for (auto &&sample : samples) {
+        for (size_t padding = 0; padding < 70; ++padding) {
+            for (size_t tail = 0; tail < 2; ++tail) {
+                std::string text = std::string(padding, 'a') + sample.bytes + std::string(tail * 5, 'b');
+                cbor::binary data(text.size() + 2);
+                data[0] = 0x78;
+                data[1] = static_cast<unsigned char>(text.size());
+                std::copy(text.begin(), text.end(), data.begin() + 2);
+                size_t offset = 0;
+                if (!cbor::validate(data.data(), data.size())
+                    || cbor::validate(data.data(), data.size(), offset, strict) != sample.valid
+                    || (!sample.valid && offset != 0)
+                    || cbor::decode(data, strict).is_string() != sample.valid
+                    || cbor::decode(data, strict_arena).is_string() != sample.valid) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    // Chunks are checked one by one, so a character may not straddle them
+    cbor::binary chunked {0x7f, 0x61, 'a', 0x62, 0xc3, 0xa9, 0x61, 0xc3, 0x61, 0xa9, 0xff};
+    size_t offset = 0;
+    if (!cbor::decode(chunked).is_string()
+        || cbor::decode(chunked, strict).is_string()
+        || cbor::validate(chunked.data(), chunked.size(), offset, strict) || offset != 6) {
+        return false;
+    }
+    std::istringstream stream(std::string(chunked.begin(), chunked.end()));
+    cbor item;
+    if (item.read(stream, strict)) {
+        return false;
+    }
+
+    // The incremental decoder checks the same chunks, however the input is
+    // split, while a definite string may be split anywhere
+    const cbor::binary split {0x7f, 0x61, 0xc3, 0x61, 0xa9, 0xff};
+    const cbor::binary whole {0x62, 0xc3, 0xa9};
+    cbor_decoder at_once(strict);
+    cbor_decoder piecewise(strict);
+    cbor_decoder definite(strict);
+    cbor_decoder::status_t status = cbor_decoder::STATUS_NEED_MORE;
+    for (unsigned char byte : split) {
+        status = piecewise.feed(&byte, 1);
+    }
+    for (unsigned char byte : whole) {
+        definite.feed(&byte, 1);
+    }
+    return at_once.feed(split.data(), split.size()) == cbor_decoder::STATUS_ERROR
+        && status == cbor_decoder::STATUS_ERROR && definite.status() == cbor_decoder::STATUS_COMPLETE
+        && definite.item().to_string() == "\xc3\xa9";
+}
+
+bool test_inline_strings()
+{
+    // Sizes on both sides of what fits in a node
+    for (size_t size = 0; size < 40; ++size) {
+        const cbor::string text(size, 'a' + size % 26);
+        const cbor::binary bytes(size, static_cast<unsigned char>(size));
+        cbor::array items {text, cbor::string(text), text.c_str(), bytes, cbor::binary(bytes)};
+        cbor copies = items;
+        cbor moved = std::move(copies);
+        const cbor::binary data = cbor::encode(moved);
+        cbor::arena arena;
+        const cbor decoded = cbor::decode(data);
+        const cbor in_arena = cbor::decode(data, arena);
+        for (auto &&tree : {moved, decoded, in_arena}) {
+            cbor::array result = tree;
+            if (result.size() != 5 || result[0].to_string() != text || result[1].to_string() != text
+                || result[2].to_string() != text || result[3].to_binary() != bytes
+                || result[4].to_binary() != bytes || result[0] != cbor(text) || result[3] != cbor(bytes)) {
+                return false;
+            }
+        }
+        if (cbor::encode(decoded) != data || cbor::encode(in_arena) != data) {
+            return false;
+        }
+    }
+
+    // Strings compare by content, so keys are found by value
+    cbor::map keys {{"b", 2}, {"a", 1}, {"a longer key than fits inline", 3}};
+    if (keys.size() != 3 || keys.at("a").to_unsigned() != 1
+        || keys.at("a longer key than fits inline").to_unsigned() != 3
+        || !(cbor("b") < cbor("aa")) || cbor("ab") < cbor("b")) {
+        return false;
+    }
+
+    cbor tagged = cbor::tagged(24, cbor::tagged(1, "nested"));
+    cbor copy = tagged;
+    cbor::arena arena;
+    const cbor decoded = cbor::decode(cbor::encode(tagged), arena);
+    return copy == tagged && decoded == tagged && decoded.child().child().to_string() == "nested";
+}
+
+bool test_map_order()
+{
+    cbor::map item {
+        {"b", 2},
+        {cbor::array {1, 2}, "pair"},
+        {"aa", 3},
+        {10, "ten"},
+        {"b", 4},
+        {cbor::array {1}, "single"},
+        {"a", 1}
+    };
+    // Integers, then strings shortest first, then arrays; the first "b" wins
+    cbor::array keys;
+    for (auto &&e : item) {
+        keys.push_back(e.first);
+    }
+    if (keys != cbor::array {10, "a", "b", "aa", cbor::array {1}, cbor::array {1, 2}}
+        || item.at("b").to_unsigned() != 2 || item.at(cbor::array {1, 2}).to_string() != "pair"
+        || item.count("c") != 0 || item.find(cbor::array {2}) != item.end()) {
+        return false;
+    }
+    bool thrown = false;
+    try {
+        item.at("missing");
+    } catch (const std::out_of_range &) {
+        thrown = true;
+    }
+    if (!thrown) {
+        return false;
+    }
+
+    item["c"] = 5;
+    item["a"] = 6;
+    if (item.size() != 7 || item.at("c").to_unsigned() != 5 || item.at("a").to_unsigned() != 6
+        || !item.emplace(11, "eleven").second || item.emplace(11, "again").second
+        || item.erase("b") != 1 || item.erase("b") != 0 || item.size() != 7) {
+        return false;
+    }
+
+    // Maps decode into key order whatever order they were written in, so
+    // encoding is deterministic
+    const unsigned char unordered[] = {0xa3, 0x61, 'b', 0x02, 0x61, 'a', 0x01, 0x00, 0x00};
+    const unsigned char ordered[] = {0xa3, 0x00, 0x00, 0x61, 'a', 0x01, 0x61, 'b', 0x02};
+    const unsigned char indefinite[] = {0xbf, 0x61, 'b', 0x02, 0x00, 0x00, 0x61, 'a', 0x01, 0xff};
+    cbor::arena arena;
+    const cbor::binary expected(ordered, ordered + sizeof(ordered));
+    for (auto &&decoded : {cbor::decode(unordered, sizeof(unordered)), cbor::decode(unordered, sizeof(unordered), arena),
+        cbor::decode(indefinite, sizeof(indefinite))}) {
+        if (cbor::encode(decoded) != expected || decoded.to_map().at("b").to_unsigned() != 2) {
+            return false;
+        }
+    }
+
+    // Duplicate keys in the input keep their first value
+    const unsigned char duplicate[] = {0xa2, 0x61, 'k', 0x01, 0x61, 'k', 0x02};
+    cbor::map decoded = cbor::decode(duplicate, sizeof(duplicate));
+    return decoded.size() == 1 && decoded.at("k").to_unsigned() == 1;
+}
+
+bool test_reference_access()
+{
+    const cbor item = cbor::map {
+        {"name", "sensor"},
+        {"a key too long to be stored inline", cbor::array {1, 2, 3}},
+        {"stamp", cbor::tagged(1, cbor::map {{"s", 15}})},
+        {0, "zero"},
+        {"raw", cbor::binary {1, 2, 3, 4}}
+    };
+    const cbor &numbers = item["a key too long to be stored inline"];
+    if (&numbers.as_array() != &item.find("a key too long to be stored inline")->as_array()
+        || numbers[2].to_unsigned() != 3 || !numbers[3].is_undefined() || numbers.size() != 3
+        || item["stamp"]["s"].to_unsigned() != 15 || item["stamp"].tagged_value().size() != 1
+        || item[cbor(0)].to_string() != "zero" || !item[0].is_undefined() || !item["missing"]["x"][1].is_undefined()
+        || item.find("missing") || item.find("name", 2) || item.size() != 5) {
+        return false;
+    }
+    const cbor &name = item["name"];
+    if (std::string(reinterpret_cast<const char *>(name.data()), name.size()) != "sensor"
+        || item["raw"].size() != 4 || item["raw"].data()[3] != 4 || numbers.data()
+        || !numbers.as_map().empty() || !name.as_array().empty()) {
+        return false;
+    }
+
+    const cbor::binary encoded = cbor::encode(item);
+    const unsigned char chunked[] = {0x5f, 0x42, 1, 2, 0x41, 3, 0xff};
+    if (cbor_view(encoded)["name"].size() != 6 || cbor_view(encoded)["raw"].size() != 4
+        || cbor_view(chunked, sizeof(chunked)).size() != 3) {
+        return false;
+    }
+
+    // Text lookups agree with lookups by cbor key on a mixed map
+    const cbor::map &entries = item.as_map();
+    for (auto &&e : entries) {
+        if (e.first.is_string()) {
+            const std::string key = e.first.to_string();
+            if (entries.find(key.c_str()) != entries.find(e.first) || entries.find(key.data(), key.size() - 1) != entries.end()) {
+                return false;
+            }
+        }
+    }
+
+    // The mutable versions edit in place and convert other values
+    cbor copy = item;
+    copy.find("name")->as_array().push_back(7);
+    copy.as_map()["new"] = true;
+    copy.find(cbor(0))->as_map()[1] = 2;
+    return copy["name"][0].to_unsigned() == 7 && copy["new"].to_bool() && copy[cbor(0)][cbor(1)].to_unsigned() == 2
+        && item["name"].is_string() && copy.size() == 6;
+}
+
+bool test_equality_and_hash()
+{
+    const cbor message = cbor::map {
+        {"id", 42},
+        {"tags", cbor::array {"a", "b", cbor::binary {1, 2}}},
+        {"meta", cbor::map {{"route", "/a/b"}, {"stamp", cbor::tagged(1, 1.5)}}}
+    };
+    const cbor::binary data = cbor::encode(message);
+    cbor::arena arena;
+    const cbor first = cbor::decode(data);
+    const cbor second = cbor::decode(data, arena);
+    std::hash<cbor> hasher;
+    if (first != message || second != message || hasher(first) != hasher(message) || hasher(second) != hasher(message)
+        || first == cbor::map {{"id", 42}} || cbor(cbor::array {1, 2}) == cbor(cbor::array {2, 1})
+        || cbor(cbor::tagged(1, 2)) == cbor(cbor::tagged(2, 2)) || cbor(1) == cbor(-1) || cbor(1) == cbor(1.0)) {
+        return false;
+    }
+
+    // Repeated messages collapse in a hash table
+    std::unordered_set<cbor> seen;
+    for (int i = 0; i < 100; ++i) {
+        seen.insert(cbor::decode(data));
+        seen.insert(cbor::map {{"n", i % 10}});
+        seen.insert(cbor::array {i % 5, "x"});
+        seen.insert("a string long enough to live on the heap " + std::to_string(i % 3));
+    }
+    if (seen.size() != 19 || !seen.count(message)) {
+        return false;
+    }
+
+    // A cached hash never outlives a change made through the map
+    cbor changing = message;
+    uint64_t before = changing.hash();
+    changing.as_map()["id"] = 43;
+    if (changing.hash() == before || changing == message) {
+        return false;
+    }
+    changing.as_map()["id"] = 42;
+    if (changing.hash() != before || changing != message) {
+        return false;
+    }
+
+    // Nor one made through a value found in the map
+    cbor a = cbor::map {{"k", 1}, {"long enough to be on the heap", 0}};
+    cbor b = cbor::map {{"k", 2}, {"long enough to be on the heap", 0}};
+    a.hash();
+    b.hash();
+    *a.find("k") = 2;
+    *a.find(cbor("long enough to be on the heap")) = 3;
+    *b.find(cbor("long enough to be on the heap")) = 3;
+    if (a != b || a.hash() != b.hash() || std::hash<cbor>()(a) != std::hash<cbor>()(b)) {
+        return false;
+    }
+    cbor::map copy = message.as_map();
+    copy.begin()->second = 7;
+    return cbor(copy).hash() != message.hash() && cbor(copy) != message;
+}
+
+template <typename Type>
+bool check_typed_array(size_t count)
+{
+    std::vector<Type> values;
+    for (size_t i = 0; i != count; ++i) {
+        values.push_back(Type(i * 37 + 1) / Type(3));
+    }
+    cbor::binary host, big;
+    cbor_writer(host).put_typed(values);
+    cbor_writer(big).put_typed(values, true);
+    const cbor built = cbor::typed_array(values);
+    if (cbor::encode(built) != host) {
+        return false;
+    }
+    cbor::arena arena;
+    for (const cbor &decoded : {cbor::decode(host), cbor::decode(big), cbor::decode(big, arena)}) {
+        cbor::span<Type> elements = decoded.to_span<Type>();
+        if (decoded != built || elements.size() != count || !std::equal(values.begin(), values.end(), elements.begin())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_typed_arrays()
+{
+    // Lengths around the 16 and 32 byte steps of the byte swapping
+    for (size_t count = 0; count < 40; ++count) {
+        if (!check_typed_array<uint8_t>(count) || !check_typed_array<uint16_t>(count)
+            || !check_typed_array<int32_t>(count) || !check_typed_array<uint64_t>(count)
+            || !check_typed_array<int16_t>(count) || !check_typed_array<float>(count)
+            || !check_typed_array<double>(count)) {
+            return false;
+        }
+    }
+
+    // float32 big endian [1.5, -2], then in the other order
+    const unsigned char big[] = {0xd8, 0x51, 0x48, 0x3f, 0xc0, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00};
+    const unsigned char little[] = {0xd8, 0x55, 0x48, 0x00, 0x00, 0xc0, 0x3f, 0x00, 0x00, 0x00, 0xc0};
+    for (auto &&decoded : {cbor::decode(big, sizeof(big)), cbor::decode(little, sizeof(little))}) {
+        cbor::span<float> elements = decoded.to_span<float>();
+        if (elements.size() != 2 || elements[0] != 1.5f || elements[1] != -2.0f || !decoded.to_span<int32_t>().empty()) {
+            return false;
+        }
+    }
+
+    // Clamped bytes read as uint8_t; a partial element leaves the bytes alone
+    const unsigned char clamped[] = {0xd8, 0x44, 0x42, 0x01, 0xff};
+    const unsigned char partial[] = {0xd8, 0x41, 0x43, 0x01, 0x02, 0x03};
+    const cbor odd = cbor::decode(partial, sizeof(partial));
+    return cbor::decode(clamped, sizeof(clamped)).to_span<uint8_t>().size() == 2
+        && odd.to_span<uint16_t>().empty() && odd.tag() == 65 && odd.child().to_binary() == cbor::binary {1, 2, 3}
+        && cbor(cbor::array {1.5f}).to_span<float>().empty();
+}
+
+bool test_statistics()
+{
+    // [1, "twenty bytes of text", {"a": 1(2)}, (_ h'01', h'02')]
+    const unsigned char data[] = {
+        0x84, 0x01, 0x74, 't', 'w', 'e', 'n', 't', 'y', ' ', 'b', 'y', 't', 'e', 's', ' ', 'o', 'f', ' ', 't', 'e',
+        'x', 't', 0xa1, 0x61, 'a', 0xc1, 0x02, 0x5f, 0x41, 0x01, 0x41, 0x02, 0xff
+    };
+    cbor::stats stats;
+    cbor::decode_options options;
+    options.stats = &stats;
+    const cbor item = cbor::decode(data, sizeof(data), options);
+    if (!item.is_array()) {
+        return false;
+    }
+
+    // The node, the array's elements, the heap string and its object, the
+    // map, its one pair, the tagged child and the chunked byte string, whose
+    // capacity depends on how it grew, and the reference counts of the five
+    // heap payloads
+    size_t expected = sizeof(cbor) + sizeof(cbor::array) + 4 * sizeof(cbor) + sizeof(cbor::string)
+        + item[1].to_string().capacity() + sizeof(cbor::map) + sizeof(cbor::map::value_type) + sizeof(cbor)
+        + sizeof(cbor::binary) + 5 * sizeof(size_t);
+    if (item.memory_usage() < expected + 2 || item.memory_usage() > expected + 16 || cbor(1).memory_usage() != sizeof(cbor)
+        || cbor("inline").memory_usage() != sizeof(cbor)) {
+        return false;
+    }
+
+#if CBOR11_STATS
+    if (stats.nodes[cbor::TYPE_ARRAY] != 1 || stats.nodes[cbor::TYPE_UNSIGNED] != 2 || stats.nodes[cbor::TYPE_STRING] != 2
+        || stats.nodes[cbor::TYPE_MAP] != 1 || stats.nodes[cbor::TYPE_TAGGED] != 1 || stats.nodes[cbor::TYPE_BINARY] != 1
+        || stats.allocations != 9 || stats.allocated_bytes == 0 || stats.max_depth != 3 || stats.indefinite_chunks != 2
+        || stats.bytes != sizeof(data) || stats.arena_bytes != 0) {
+        return false;
+    }
+    cbor::arena arena;
+    cbor::stats arena_stats;
+    options.arena = &arena;
+    options.stats = &arena_stats;
+    cbor::decode(data, sizeof(data), options);
+    if (arena_stats.arena_bytes != arena.bytes_allocated() || arena_stats.allocations != 2) {
+        return false;
+    }
+    cbor::stats encoding;
+    const cbor::binary encoded = cbor::encode(item, encoding);
+    return encoding.bytes == encoded.size() && encoding.allocations == 1 && encoding.nodes[cbor::TYPE_STRING] == 2
+        && encoding.max_depth == 3;
+#else
+    // Without CBOR11_STATS nothing is recorded
+    cbor::encode(item, stats);
+    return stats.allocations == 0 && stats.bytes == 0 && stats.nodes[cbor::TYPE_ARRAY] == 0;
+#endif
+}
+
+bool test_decode_limits()
+{
+    // Headers claiming far more than the input holds fail without reserving it
+    const cbor::binary huge[] = {
+        {0x9b, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0xbb, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x5b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00},
+        {0x7b, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x61}
+    };
+    cbor::arena arena;
+    for (const cbor::binary &data : huge) {
+        std::istringstream stream(std::string(data.begin(), data.end()));
+        cbor item;
+        if (!cbor::decode(data).is_undefined() || !cbor::decode(data, arena).is_undefined() || item.read(stream)) {
+            return false;
+        }
+    }
+
+    // Nesting is limited by default, the other limits only when set
+    cbor::binary deep(100000, 0x81);
+    deep.push_back(0x00);
+    if (!cbor::decode(deep).is_undefined()) {
+        return false;
+    }
+    const cbor::binary data = cbor::encode(cbor::array {cbor::map {{"key", "a longer text value"}}, 2, 3});
+    struct {
+        cbor::decode_options options;
+        bool valid = false;
+    } cases[5];
+    cases[0].options.max_depth = 1;
+    cases[1].options.max_depth = 2;
+    cases[1].valid = true;
+    cases[2].options.max_bytes = data.size() - 1;
+    cases[3].options.max_items = 2;
+    cases[4].options.max_string_length = 18;
+    for (auto &&test : cases) {
+        if (cbor::decode(data, test.options).is_undefined() == test.valid) {
+            return false;
+        }
+    }
+    cbor::decode_options options;
+    options.max_nodes = 6;
+    if (cbor::decode(data, options) != cbor::decode(data)) {
+        return false;
+    }
+    options.max_nodes = 5;
+    if (!cbor::decode(data, options).is_undefined()) {
+        return false;
+    }
+
+    // Indefinite-length items are held to the same limits as they arrive
+    const cbor::binary chunked = {0x9f, 0x7f, 0x62, 'a', 'b', 0x62, 'c', 'd', 0xff, 0x01, 0x02, 0xff};
+    cbor::decode_options strings;
+    strings.max_string_length = 3;
+    cbor::decode_options items;
+    items.max_items = 2;
+    cbor::decode_options bytes;
+    bytes.max_bytes = chunked.size() - 1;
+    std::istringstream stream(std::string(chunked.begin(), chunked.end()));
+    cbor item;
+    return cbor::decode(chunked).is_array() && cbor::decode(chunked, strings).is_undefined()
+        && cbor::decode(chunked, items).is_undefined() && !item.read(stream, bytes);
+}
+
+bool test_parallel_decode()
+{
+    cbor::array records;
+    for (int i = 0; i < 5000; ++i) {
+        records.push_back(cbor::map {
+            {"id", i},
+            {"name", "record number " + std::to_string(i)},
+            {"values", cbor::array {i, i * 0.5, cbor::binary(i % 40, i & 0xff)}}
+        });
+    }
+    const cbor expected = records;
+    const cbor::binary data = cbor::encode(expected);
+    if (cbor::decode_parallel(data.data(), data.size(), 4) != expected
+        || cbor::decode_parallel(data.data(), data.size(), 1) != expected) {
+        return false;
+    }
+
+    // Threads decode into arenas of their own that end up in the caller's
+    cbor::arena arena;
+    cbor::decode_options options;
+    options.arena = &arena;
+    const size_t blocks = arena.block_count();
+    const cbor in_arena = cbor::decode_parallel(data.data(), data.size(), options, 4);
+    if (in_arena != expected || arena.block_count() <= blocks + 1) {
+        return false;
+    }
+
+    // Indefinite-length arrays and sequences of the same items
+    cbor::binary indefinite {0x9f};
+    cbor::binary sequence;
+    for (const cbor &record : records) {
+        cbor::encode_into(record, indefinite);
+        cbor::encode_into(record, sequence);
+    }
+    indefinite.push_back(0xff);
+    cbor::array items;
+    if (cbor::decode_parallel(indefinite.data(), indefinite.size(), 3) != expected
+        || !cbor::decode_sequence(sequence.data(), sequence.size(), items, 3) || items != records) {
+        return false;
+    }
+
+    // Empty arrays and sequences leave nothing for the threads to decode
+    const cbor::binary empty {0x80};
+    const cbor::binary empty_indefinite {0x9f, 0xff};
+    const cbor::binary empty_trailing {0x80, 0x52, 0x83, 0x01, 0xf7, 0x61, 0xcc};
+    if (cbor::decode_parallel(empty.data(), empty.size(), 2) != cbor::array()
+        || cbor::decode_parallel(empty_indefinite.data(), empty_indefinite.size(), 4) != cbor::array()
+        || !cbor::decode_parallel(empty_trailing.data(), empty_trailing.size(), 2).is_undefined()
+        || !cbor::decode_sequence(empty.data(), 0, items, 2) || !items.empty()) {
+        return false;
+    }
+
+    // Malformed or truncated items, trailing bytes and limits fail the whole
+    cbor::binary malformed;
+    for (size_t i = 0; i != records.size(); ++i) {
+        cbor::encode_into(records[i], malformed);
+        if (i == records.size() / 2) {
+            malformed.push_back(0x1c);
+        }
+    }
+    cbor::decode_options limited;
+    limited.max_items = records.size() - 1;
+    const cbor::binary scalar {0x18, 0x2a};
+
+    // The node limit holds for all threads together: each record is ten
+    // nodes, and the array one more
+    cbor::decode_options nodes;
+    nodes.max_nodes = records.size() * 10 + 1;
+    if (cbor::decode_parallel(data.data(), data.size(), nodes, 4) != expected) {
+        return false;
+    }
+    --nodes.max_nodes;
+    if (!cbor::decode_parallel(data.data(), data.size(), nodes, 4).is_undefined()) {
+        return false;
+    }
+    return cbor::decode_parallel(data.data(), data.size() - 1, 4).is_undefined()
+        && cbor::decode_parallel(indefinite.data(), indefinite.size() - 1, 4).is_undefined()
+        && !cbor::decode_sequence(malformed.data(), malformed.size(), items, 4) && items.empty()
+        && cbor::decode_parallel(data.data(), data.size(), limited, 4).is_undefined()
+        && !cbor::decode_sequence(sequence.data(), sequence.size(), items, limited, 4)
+        && cbor::decode_parallel(scalar.data(), scalar.size()).to_unsigned() == 42;
+}
+
+bool test_sequences()
+{
+    // Enough items, one of them larger than a read block, for a stream to
+    // be read in several blocks with items across their boundaries
+    cbor::array items;
+    for (int i = 0; i < 3000; ++i) {
+        items.push_back(cbor::array {i, "sequence item number " + std::to_string(i), cbor::map {{"even", i % 2 == 0}}});
+    }
+    items.push_back(cbor::binary(200000, 0x5a));
+    items.push_back(cbor());
+    items.push_back(cbor::null);
+
+    cbor::binary data;
+    cbor_sequence_writer memory(data);
+    memory.write_batch(items);
+    std::ostringstream out;
+    {
+        cbor_sequence_writer stream(out, 1000);
+        for (const cbor &item : items) {
+            stream.write(item);
+        }
+        if (stream.count() != items.size()) {
+            return false;
+        }
+    }
+    if (memory.count() != items.size() || out.str() != std::string(data.begin(), data.end())) {
+        return false;
+    }
+
+    cbor_sequence_reader from_memory(data.data(), data.size());
+    std::istringstream in(out.str());
+    cbor_sequence_reader from_stream(in);
+    cbor::array batch;
+    cbor::array read;
+    while (from_stream.next_batch(7, batch)) {
+        read.insert(read.end(), batch.begin(), batch.end());
+    }
+    if (from_memory.next_batch(items.size() + 1) != items || read != items || from_memory.error()
+        || from_stream.error() || from_stream.offset() != data.size()) {
+        return false;
+    }
+
+    // Items read from a stream do not borrow from its buffer, so they stay
+    // valid while the buffer is refilled for later ones
+    cbor::decode_options borrowing;
+    borrowing.borrow = true;
+    std::istringstream kept_stream(out.str());
+    cbor_sequence_reader kept_reader(kept_stream, borrowing);
+    cbor first;
+    cbor later;
+    if (!kept_reader.next(first)) {
+        return false;
+    }
+    while (kept_reader.next(later)) { }
+    if (first != items[0] || first[1].to_string() != "sequence item number 0" || kept_reader.error()) {
+        return false;
+    }
+
+    // A truncated last item is an error, after the items before it
+    cbor::binary truncated = cbor::encode(1);
+    cbor::encode_into(cbor("text"), truncated);
+    truncated.pop_back();
+    std::istringstream truncated_stream(std::string(truncated.begin(), truncated.end()));
+    cbor_sequence_reader reader(truncated_stream);
+    cbor item;
+    if (!reader.next(item) || item.to_unsigned() != 1 || reader.next(item) || !reader.error() || reader.offset() != 1) {
+        return false;
+    }
+
+    // So is a malformed one, and the options apply to every item
+    const cbor::binary malformed {0x01, 0x1c, 0x02};
+    cbor_sequence_reader bad(malformed.data(), malformed.size());
+    cbor::decode_options options;
+    options.max_items = 2;
+    cbor_sequence_reader limited(data.data(), data.size(), options);
+    return bad.next_batch(3).size() == 1 && bad.error() && !limited.next(item) && limited.error();
+}
+
+bool test_mapped_file()
+{
+    // A big-endian typed array must be copied to be swapped; the long text
+    // and the byte string are left in the file
+    cbor::binary typed(3 + 16);
+    typed[0] = 0xd8;
+    typed[1] = 0x52;
+    typed[2] = 0x50;
+    for (size_t i = 0; i < 2; ++i) {
+        typed[3 + i * 8] = 0x3f;
+        typed[4 + i * 8] = 0xf0;
+    }
+    const cbor expected = cbor::array {"a text long enough not to be inline", cbor::binary(100, 7), "short",
+        cbor::decode(typed)};
+    const cbor::binary data = cbor::encode(expected);
+    const std::string path = "cbor11_mapped_file.cbor";
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    }
+
+    cbor::file copy;
+    const unsigned char *text = nullptr;
+    {
+        cbor::file file(path);
+        if (!file.valid() || file.root() != expected || file.size() != data.size()
+            || file.view()[2].to_string() != "short") {
+            return false;
+        }
+        text = file.root()[0].data();
+        const unsigned char *bytes = file.root()[1].data();
+        const unsigned char *doubles = file.root()[3].tagged_value().data();
+        if (text < file.data() || bytes < file.data() || bytes + 100 > file.data() + file.size()
+            || (doubles >= file.data() && doubles < file.data() + file.size())) {
+            return false;
+        }
+        copy = file;
+    }
+    // The copy keeps the mapping, and the tree borrowing from it, alive
+    cbor::span<double> values = copy.root()[3].to_span<double>();
+    bool kept = copy.root()[0].data() == text && copy.root() == expected && values.size() == 2 && values[1] == 1.0;
+
+    // Decoding from memory can borrow in the same way
+    cbor::decode_options options;
+    options.borrow = true;
+    const cbor borrowed = cbor::decode(data, options);
+    const unsigned char *from = borrowed[0].data();
+    bool in_place = borrowed == expected && from >= data.data() && from < data.data() + data.size();
+
+    std::remove(path.c_str());
+    cbor::file missing(path);
+    return kept && in_place && !missing.valid() && missing.root().is_undefined() && missing.size() == 0;
+}
+
+bool test_incremental_decoder()
+{
+    const cbor expected = cbor::array {
+        1, -1000000, "caf\xc3\xa9 au lait, with enough text to leave the node", cbor::binary(300, 0x42),
+        cbor::map {{"nested", cbor::array {true, cbor::null, 1.5}}, {1, cbor::tagged(32, "http://x")}},
+        cbor::typed_array(std::vector<uint32_t> {1, 2, 3})
+    };
+    const cbor::binary data = cbor::encode(expected);
+
+    // Every way of splitting the input gives the same item, a byte at a
+    // time included
+    cbor::decode_options strict;
+    strict.strict_utf8 = true;
+    cbor_decoder decoder(strict);
+    for (size_t piece : {size_t(1), size_t(2), size_t(7), size_t(64), data.size()}) {
+        cbor_decoder::status_t status = cbor_decoder::STATUS_NEED_MORE;
+        for (size_t offset = 0; offset < data.size(); offset += piece) {
+            if (status != cbor_decoder::STATUS_NEED_MORE) {
+                return false;
+            }
+            status = decoder.feed(data.data() + offset, std::min(piece, data.size() - offset));
+        }
+        if (status != cbor_decoder::STATUS_COMPLETE || decoder.position() != data.size() || decoder.take() != expected) {
+            return false;
+        }
+    }
+
+    // Two messages in one piece: the second is left for the next item
+    cbor::binary two = cbor::encode(cbor::array {1, 2});
+    cbor::encode_into(cbor("next"), two);
+    if (decoder.feed(two.data(), two.size()) != cbor_decoder::STATUS_COMPLETE || decoder.consumed() != 3
+        || decoder.feed(two.data(), two.size()) != cbor_decoder::STATUS_COMPLETE || decoder.consumed() != 0
+        || decoder.take() != cbor::array {1, 2}
+        || decoder.feed(two.data() + 3, two.size() - 3) != cbor_decoder::STATUS_COMPLETE || decoder.item() != "next") {
+        return false;
+    }
+
+    // Malformed input, invalid UTF-8 and limits are errors as soon as seen
+    decoder.reset();
+    const unsigned char malformed[] = {0x82, 0x01, 0x1c};
+    const unsigned char bad_text[] = {0x62, 0xc3, 0x28};
+    if (decoder.feed(malformed, 2) != cbor_decoder::STATUS_NEED_MORE
+        || decoder.feed(malformed + 2, 1) != cbor_decoder::STATUS_ERROR || decoder.position() != 2) {
+        return false;
+    }
+    decoder.reset();
+    if (decoder.feed(bad_text, sizeof(bad_text)) != cbor_decoder::STATUS_ERROR) {
+        return false;
+    }
+    cbor::decode_options limited;
+    limited.max_depth = 3;
+    limited.max_bytes = 100;
+    cbor_decoder bounded(limited);
+    const cbor::binary deep(5, 0x81);
+    const cbor::binary large = cbor::encode(cbor::binary(200, 0));
+    if (bounded.feed(deep.data(), deep.size()) != cbor_decoder::STATUS_ERROR) {
+        return false;
+    }
+    bounded.reset();
+    return bounded.feed(large.data(), large.size()) == cbor_decoder::STATUS_ERROR && bounded.consumed() == 100;
+}
+
+enum class color : uint8_t {
+    red,
+    green,
+    blue
+};
+
+struct address {
+    std::string city;
+    uint16_t zip;
+};
+CBOR11_FIELDS(address, city, zip)
+
+struct person {
+    std::string name;
+    int age;
+    double score;
+    bool admin;
+    color favourite;
+    std::vector<address> addresses;
+    std::map<std::string, int64_t> counters;
+    cbor::binary avatar;
+    cbor extra;
+};
+CBOR11_FIELDS(person, name, age, score, admin, favourite, addresses, counters, avatar, extra)
+
+bool same_person(const person &left, const person &right)
+{
+    if (left.name != right.name || left.age != right.age || left.score != right.score || left.admin != right.admin
+        || left.favourite != right.favourite || left.addresses.size() != right.addresses.size()
+        || left.counters != right.counters || left.avatar != right.avatar || left.extra != right.extra) {
+        return false;
+    }
+    for (size_t i = 0; i != left.addresses.size(); ++i) {
+        if (left.addresses[i].city != right.addresses[i].city || left.addresses[i].zip != right.addresses[i].zip) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_struct_mapping()
+{
+    const person alice {"Alice", 42, 97.5, true, color::blue, {{"Aarhus", 8000}, {"Odense", 5000}},
+        {{"logins", 17}, {"errors", -3}}, {0xde, 0xad}, cbor::array {1, "two"}};
+    const cbor::binary data = cbor::encode_value(alice);
+
+    // The encoding is the map of the fields, in the order they are listed
+    const cbor tree = cbor::map {
+        {"name", "Alice"}, {"age", 42}, {"score", 97.5}, {"admin", true}, {"favourite", 2},
+        {"addresses", cbor::array {cbor::map {{"city", "Aarhus"}, {"zip", 8000}},
+            cbor::map {{"city", "Odense"}, {"zip", 5000}}}},
+        {"counters", cbor::map {{"logins", 17}, {"errors", -3}}}, {"avatar", cbor::binary {0xde, 0xad}},
+        {"extra", cbor::array {1, "two"}}
+    };
+    const cbor_view first = cbor_view(data).find("name");
+    person decoded;
+    if (cbor::decode(data) != tree || first.data() != data.data() + 6 || !cbor::decode_value(data, decoded)
+        || !same_person(decoded, alice)) {
+        return false;
+    }
+
+    // Fields come in any order, unknown keys are skipped and missing fields
+    // keep their value
+    cbor::map other = tree.to_map();
+    other.erase("score");
+    other["nickname"] = "Al";
+    other[7] = cbor::array {1, 2};
+    person partial;
+    partial.score = 1.25;
+    if (!cbor::decode_value(cbor::encode(other), partial) || partial.score != 1.25 || partial.name != "Alice"
+        || partial.addresses.size() != 2 || partial.addresses[1].zip != 5000) {
+        return false;
+    }
+
+    // Indefinite-length containers and strings
+    cbor::binary chunked;
+    cbor_writer writer(chunked);
+    writer.begin_map();
+    writer.put("city");
+    writer.put(cbor::decode(cbor::binary {0x7f, 0x62, 'V', 'e', 0x61, 'j', 0xff}));
+    writer.put("zip");
+    writer.put(7100);
+    writer.end();
+    address place;
+    if (!cbor::decode_value(chunked, place) || place.city != "Vej" || place.zip != 7100) {
+        return false;
+    }
+
+    // Vectors of bool, whose items are not objects of their own
+    const std::vector<bool> flags {true, false, true};
+    std::vector<bool> decoded_flags;
+    if (!cbor::decode_value(cbor::encode_value(flags), decoded_flags) || decoded_flags != flags) {
+        return false;
+    }
+
+    // Values of the wrong type or out of range, and trailing bytes, fail
+    address wrong;
+    cbor::binary trailing = cbor::encode_value(place);
+    trailing.push_back(0x00);
+    return !cbor::decode_value(cbor::encode(cbor::map {{"zip", "7100"}}), wrong)
+        && !cbor::decode_value(cbor::encode(cbor::map {{"zip", 70000}}), wrong)
+        && !cbor::decode_value(cbor::encode(cbor::map {{"zip", -1}}), wrong)
+        && !cbor::decode_value(trailing, wrong) && !cbor::decode_value(cbor::encode(cbor::array {}), wrong);
+}
+
+bool test_key_interning()
+{
+    cbor::array records;
+    for (int i = 0; i < 100; ++i) {
+        records.push_back(cbor::map {
+            {"id", i}, {"temperature_celsius_average", i * 0.5}, {"relative_humidity_percent", i % 7}
+        });
+    }
+    const cbor expected = records;
+    const cbor::binary data = cbor::encode(expected);
+
+    // Every record points at the same copy of each long key, while short
+    // keys stay in their nodes
+    cbor::intern_table table;
+    cbor::decode_options options;
+    options.intern = &table;
+    const cbor decoded = cbor::decode(data, options);
+    const unsigned char *first = decoded[0].as_map().begin()[1].first.data();
+    const unsigned char *last = decoded[99].as_map().begin()[1].first.data();
+    if (decoded != expected || first != last || table.size() != 2 || table.lookups() != 200 || table.hits() != 198
+        || table.bytes() != 52 || table.hit_rate() != 0.99) {
+        return false;
+    }
+
+    // The table is shared across messages and stream reads, and copies of a
+    // tree keep their own keys
+    std::stringstream stream;
+    expected.write(stream);
+    cbor streamed;
+    if (!streamed.read(stream, options) || streamed != expected
+        || streamed[5].as_map().begin()[1].first.data() != first || table.hits() != 398) {
+        return false;
+    }
+    const cbor copy = decoded;
+    table.clear();
+    if (copy != expected || table.size() != 0 || table.lookups() != 0) {
+        return false;
+    }
+
+    // A full table leaves new keys to the usual decoding, in the arena or
+    // in the input when those are asked for
+    cbor::intern_table small(1);
+    cbor::arena arena;
+    options.intern = &small;
+    options.arena = &arena;
+    const cbor bounded = cbor::decode(data, options);
+    options.arena = nullptr;
+    options.borrow = true;
+    const cbor borrowed = cbor::decode(data, options);
+    const unsigned char *key = borrowed[3].as_map().begin()[2].first.data();
+    if (bounded != expected || borrowed != expected || small.size() != 1 || small.hits() != 199
+        || key < data.data() || key >= data.data() + data.size()) {
+        return false;
+    }
+
+    // The table grows with its keys, however many it may take
+    cbor::intern_table unbounded(SIZE_MAX, SIZE_MAX);
+    cbor::decode_options growing;
+    growing.intern = &unbounded;
+    cbor::map wide;
+    for (int i = 0; i < 100; ++i) {
+        wide["a key long enough to intern " + std::to_string(i)] = i;
+    }
+    const cbor::binary wide_data = cbor::encode(wide);
+    if (cbor::decode(wide_data, growing) != wide || cbor::decode(wide_data, growing) != wide || unbounded.size() != 100
+        || unbounded.hits() != 100) {
+        return false;
+    }
+
+    // Keys are checked before they are shared
+    options.strict_utf8 = true;
+    cbor::binary invalid = cbor::encode(cbor::map {{"temperature_celsius_averag\xff", 1}});
+    return !cbor::decode(invalid, options).is_map() && small.lookups() == 400;
+}
+
+bool test_copy_on_write()
+{
+    cbor::array rows;
+    for (int i = 0; i < 1000; ++i) {
+        rows.push_back(cbor::map {{"id", i}, {"tags", cbor::array {"a", "b"}}, {"note", std::string(40, 'x')}});
+    }
+    const cbor original = cbor::tagged(7, rows);
+    const cbor expected = original;
+
+    // Copies share the payloads until one of them is changed
+    cbor copy = original;
+    const cbor &shared = copy;
+    const cbor child = original.child();
+    if (&shared.as_array() != &original.as_array() || shared[5]["note"].data() != original[5]["note"].data()
+        || &child.as_array() != &original.as_array()) {
+        return false;
+    }
+
+    // Changing the copy copies only the containers on the way to the change
+    copy.as_array().push_back(1);
+    *copy.as_array()[3].find("id") = "changed";
+    copy.as_array()[4].as_map()["tags"].as_array().clear();
+    if (original != expected || copy.size() != 1001 || copy[3]["id"].to_string() != "changed"
+        || copy[4]["tags"].size() != 0 || original[4]["tags"].size() != 2 || &shared.as_array() == &original.as_array()
+        || &shared[5].as_map() != &original[5].as_map() || &shared[4].as_map() == &original[4].as_map()) {
+        return false;
+    }
+
+    // Copies made, changed and dropped on several threads leave the original
+    // alone
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&original, t]() {
+            for (int i = 0; i < 200; ++i) {
+                cbor local = original;
+                local.as_array()[i].as_map()["id"] = t;
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    if (original != expected) {
+        return false;
+    }
+
+    // Trees holding strings borrowed from their input are copied in full
+    const cbor::binary data = cbor::encode(rows);
+    cbor::decode_options options;
+    options.borrow = true;
+    const cbor borrowed = cbor::decode(data, options);
+    const cbor independent = borrowed;
+    const unsigned char *note = independent[0]["note"].data();
+    return independent == borrowed && borrowed[0]["note"].data() != note
+        && (note < data.data() || note >= data.data() + data.size());
+}
+
+bool test_path_queries()
+{
+    cbor::array items;
+    for (int i = 0; i < 10; ++i) {
+        items.push_back(cbor::map {{"id", i}, {"name", "item " + std::to_string(i)}});
+    }
+    const cbor message = cbor::map {
+        {"meta", cbor::map {{"route", "/api/v1/users"}, {"ts", 1500000000}}},
+        {"items", items},
+        {"blob", cbor::binary(100000, 7)}
+    };
+    const cbor::binary data = cbor::encode(message);
+    const cbor_view view(data);
+
+    // Lookups give the encoded item in place, or its decoded subtree
+    const cbor_view route = view.path("meta.route");
+    const cbor_view id = view.path("items[3].id");
+    if (route.to_string() != "/api/v1/users" || route.data() < data.data() || route.data() >= data.data() + data.size()
+        || cbor::decode(route.data(), route.encoded_size()) != "/api/v1/users" || id.to_unsigned() != 3
+        || view.path(std::string("items[9]")).to_cbor() != items[9] || view.path("").data() != data.data()
+        || cbor_view(cbor::encode(items)).path("[2].name").to_string() != "item 2") {
+        return false;
+    }
+
+    // Paths that lead nowhere or do not parse give an invalid view
+    const char *missing[] = {
+        "items[10].id", "meta.route.x", "meta.method", "items.id", "meta[0]", "items[x]", "items[3", "meta..route",
+        ".meta", "items[3]id", "meta."
+    };
+    for (const char *query : missing) {
+        if (view.path(query).valid()) {
+            return false;
+        }
+    }
+
+    // Indefinite-length maps, arrays and keys are walked as well
+    cbor::binary chunked;
+    cbor_writer writer(chunked);
+    writer.begin_map();
+    writer.put(cbor::decode(cbor::binary {0x7f, 0x62, 'i', 't', 0x63, 'e', 'm', 's', 0xff}));
+    writer.begin_array();
+    writer.put(1);
+    writer.put(cbor::map {{"id", 2}});
+    writer.end();
+    writer.end();
+    if (cbor_view(chunked).path("items[1].id").to_unsigned() != 2
+        || cbor_view(chunked).project({"items[1].id"}) != cbor::map {{"items", cbor::array {cbor::undefined,
+            cbor::map {{"id", 2}}}}}) {
+        return false;
+    }
+
+    // A projection holds what lies on the paths and nothing else, with
+    // undefined for array elements left out
+    const cbor projected = view.project({"meta.route", "items[3].id", "items[1]", "meta.missing", "blob[0]"});
+    const cbor expected = cbor::map {
+        {"meta", cbor::map {{"route", "/api/v1/users"}}},
+        {"items", cbor::array {cbor::undefined, items[1], cbor::undefined, cbor::map {{"id", 3}}}}
+    };
+
+    // Items that can be skipped but not decoded, like arrays nested deeper
+    // than decoding allows, are left out too
+    cbor::binary malformed {0xa2, 0x62, 'o', 'k', 0xf7, 0x63, 'b', 'a', 'd'};
+    malformed.insert(malformed.end(), 3000, 0x81);
+    malformed.push_back(0x00);
+    return projected == expected && view.project({"meta", "meta.route"})["meta"] == message["meta"] && view.project({""}) == message
+        && view.project({"missing"}).is_undefined() && view.project({"meta..route"}).is_undefined()
+        && cbor_view(malformed).project({"bad"}).is_undefined()
+        && cbor_view(malformed).project({"ok"}) == cbor::map {{"ok", cbor::undefined}};
+}
+
 int main(int argc, char **argv)
 {
     if(argc < 2)
@@ -48,12 +1479,36 @@ int main(int argc, char **argv)
     std::pair<std::string, bool(*)()> tests[] =
     {
         { "serialize_deserialize_complex_structure", &test_serialization_deserialization, },
-        { "test_incomplete_data", &test_incomplete_data }
+        { "test_incomplete_data", &test_incomplete_data },
+        { "decode_from_memory", &test_decode_from_memory },
+        { "encode_into_buffer", &test_encode_into_buffer },
+        { "move_semantics", &test_move_semantics },
+        { "decode_into_arena", &test_decode_into_arena },
+        { "view", &test_view },
+        { "event_parser", &test_event_parser },
+        { "writer", &test_writer },
+        { "validate_offsets", &test_validate_offsets },
+        { "strict_utf8", &test_strict_utf8 },
+        { "inline_strings", &test_inline_strings },
+        { "map_order", &test_map_order },
+        { "reference_access", &test_reference_access },
+        { "equality_and_hash", &test_equality_and_hash },
+        { "typed_arrays", &test_typed_arrays },
+        { "statistics", &test_statistics },
+        { "decode_limits", &test_decode_limits },
+        { "parallel_decode", &test_parallel_decode },
+        { "sequences", &test_sequences },
+        { "mapped_file", &test_mapped_file },
+        { "incremental_decoder", &test_incremental_decoder },
+        { "struct_mapping", &test_struct_mapping },
+        { "key_interning", &test_key_interning },
+        { "copy_on_write", &test_copy_on_write },
+        { "path_queries", &test_path_queries }
     };
 
-    for(int i = 0; i < sizeof(tests); i++) {
-        if(tests[i].first == argv[1]) {
-            return !tests[i].second();
+    for(auto&& test : tests) {
+        if(test.first == argv[1]) {
+            return !test.second();
         }
     }
 